@@ -0,0 +1,96 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+# Copyright (c) 2023 NKI/AVL, Netherlands Cancer Institute
+
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# This cmake extension writes the properties defined in data.json.schema as
+# initializers for the constexpr table in src/property-table.hpp, so the
+# schema does not have to be parsed at runtime.
+
+#[=======================================================================[.rst:
+.. command:: write_property_table
+
+  Write the property names and types found in a JSON schema::
+
+	write_property_table(<schema> <output>)
+
+  For each member of ``definitions/Properties/properties`` in ``<schema>``
+  a line ``{ "<name>", PropertyType::<type> },`` is written to ``<output>``.
+  The type is the first of string, number or boolean in the type of the
+  property, properties of other types are left out. The file is only
+  rewritten when its content changes and cmake reruns when the schema
+  changes.
+#]=======================================================================]
+
+function(write_property_table _schema _output)
+
+	set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS "${_schema}")
+
+	file(READ "${_schema}" _json)
+	string(JSON _properties GET "${_json}" definitions Properties properties)
+	string(JSON _count LENGTH "${_properties}")
+
+	get_filename_component(_schema_name "${_schema}" NAME)
+	set(_content "// Generated from ${_schema_name} by cmake/PropertyTable.cmake, do not edit\n")
+
+	if(_count GREATER 0)
+		math(EXPR _last "${_count} - 1")
+
+		foreach(_i RANGE ${_last})
+			string(JSON _name MEMBER "${_properties}" ${_i})
+			string(JSON _kind TYPE "${_properties}" "${_name}" type)
+
+			set(_types)
+			if(_kind STREQUAL "ARRAY")
+				string(JSON _n LENGTH "${_properties}" "${_name}" type)
+				math(EXPR _n "${_n} - 1")
+				foreach(_j RANGE ${_n})
+					string(JSON _t GET "${_properties}" "${_name}" type ${_j})
+					list(APPEND _types "${_t}")
+				endforeach()
+			elseif(_kind STREQUAL "STRING")
+				string(JSON _types GET "${_properties}" "${_name}" type)
+			endif()
+
+			foreach(_t IN LISTS _types)
+				if(_t STREQUAL "string")
+					string(APPEND _content "{ \"${_name}\", PropertyType::String },\n")
+				elseif(_t STREQUAL "number")
+					string(APPEND _content "{ \"${_name}\", PropertyType::Number },\n")
+				elseif(_t STREQUAL "boolean")
+					string(APPEND _content "{ \"${_name}\", PropertyType::Boolean },\n")
+				else()
+					continue()
+				endif()
+				break()
+			endforeach()
+		endforeach()
+	endif()
+
+	if(EXISTS "${_output}")
+		file(READ "${_output}" _old)
+	endif()
+
+	if(NOT "${_old}" STREQUAL "${_content}")
+		file(WRITE "${_output}" "${_content}")
+	endif()
+endfunction()
@@ -17,14 +17,24 @@ drop table if exists software cascade;
 
 drop table if exists dbentry cascade;
 
+drop table if exists rescan_manifest cascade;
+
+drop table if exists rescan_checkpoint cascade;
+
+drop sequence if exists ingest_generation;
+
+drop table if exists ingest_state cascade;
+
 -- software
 create table software (
 	id serial primary key,
 	name varchar not null,
-	version varchar,
-	unique(name, version)
+	version varchar
 );
 
+-- unique per name and version, also when the version is not known
+create unique index software_name_version_idx on software (name, (coalesce(version, '')));
+
 -- property
 create table property (
 	id serial primary key,
@@ -45,28 +55,24 @@ create table dbentry (
 	reflections_edited boolean,
 	created timestamp with time zone default current_timestamp not null,
 	data_time date not null,
+	is_latest boolean default false not null,
 	unique(pdb_id, version_hash)
 );
 
--- a view on dbentry containing only the latest version, based on data_time
+-- the order in which query results are returned, used for paging
+create index dbentry_order_idx on dbentry (pdb_id, data_time, version_hash);
+
+-- the latest version per pdb_id, based on data_time, is_latest is maintained on insert
+create index dbentry_latest_idx on dbentry (pdb_id, data_time, version_hash) where is_latest;
+
+-- a view on dbentry containing only the latest version
 create view latest_dbentry as
 select
 	e.*
 from
 	dbentry e
 where
-	e.version_hash = (
-		select
-			e1.version_hash
-		from
-			dbentry e1
-		where
-			e1.pdb_id = e.pdb_id
-		order by
-			e1.data_time desc
-		limit
-			1
-	);
+	e.is_latest;
 
 -- dbentry_software
 create table dbentry_software (
@@ -136,6 +142,27 @@ from
 	dbentry_property_boolean pn
 	join property p on p.id = pn.property_id;
 
+-- the state of the attic directories as seen by the last rescan
+create table rescan_manifest (
+	pdb_id varchar primary key,
+	mtime bigint not null,
+	hashes varchar not null
+);
+
+-- the shards completed by the current or last rescan
+create table rescan_checkpoint (
+	shard varchar primary key,
+	completed timestamp with time zone default current_timestamp not null
+);
+
+-- the generation is bumped after each change to the entries, invalidating cached
+-- query results. Not a sequence, a standby sees those ahead of the primary.
+create table ingest_state (
+	generation bigint not null
+);
+
+insert into ingest_state (generation) values (1);
+
 -- permissions
 alter table
 	software owner to "${owner}";
@@ -158,6 +185,15 @@ alter table
 alter table
 	dbentry_property_boolean owner to "${owner}";
 
+alter table
+	rescan_manifest owner to "${owner}";
+
+alter table
+	rescan_checkpoint owner to "${owner}";
+
+alter table
+	ingest_state owner to "${owner}";
+
 alter view
 	dbentry_software_view owner to "${owner}";
 
@@ -0,0 +1,105 @@
+-- Bring a database created by an older version up to date, keeping the
+-- entries. Each step can be run again, the script is run as one transaction.
+
+-- dbentry, the latest version flag set from the newest version per pdb_id
+alter table dbentry add column if not exists is_latest boolean default false not null;
+
+update dbentry e
+set
+	is_latest = (e.id = l.id)
+from
+	(
+		select distinct on (pdb_id)
+			pdb_id,
+			id
+		from
+			dbentry
+		order by
+			pdb_id,
+			data_time desc,
+			id desc
+	) l
+where
+	e.pdb_id = l.pdb_id
+	and e.is_latest <> (e.id = l.id);
+
+create index if not exists dbentry_order_idx on dbentry (pdb_id, data_time, version_hash);
+
+create index if not exists dbentry_latest_idx on dbentry (pdb_id, data_time, version_hash) where is_latest;
+
+create or replace view latest_dbentry as
+select
+	e.*
+from
+	dbentry e
+where
+	e.is_latest;
+
+-- software, rows for the same name without version are merged into the first one
+with duplicate as (
+	select
+		id,
+		min(id) over (partition by name, coalesce(version, '')) as keep
+	from
+		software
+),
+moved as (
+	insert into dbentry_software (dbentry_id, software_id)
+	select
+		es.dbentry_id,
+		d.keep
+	from
+		dbentry_software es
+		join duplicate d on d.id = es.software_id
+	where
+		d.id <> d.keep
+	on conflict do nothing
+)
+delete from software s
+using duplicate d
+where
+	s.id = d.id
+	and d.id <> d.keep;
+
+alter table software drop constraint if exists software_name_version_key;
+
+create unique index if not exists software_name_version_idx on software (name, (coalesce(version, '')));
+
+-- the state of the attic directories as seen by the last rescan
+create table if not exists rescan_manifest (
+	pdb_id varchar primary key,
+	mtime bigint not null,
+	hashes varchar not null
+);
+
+-- the shards completed by the current or last rescan
+create table if not exists rescan_checkpoint (
+	shard varchar primary key,
+	completed timestamp with time zone default current_timestamp not null
+);
+
+-- the ingest generation, a table replacing the sequence used before
+drop sequence if exists ingest_generation;
+
+create table if not exists ingest_state (
+	generation bigint not null
+);
+
+insert into ingest_state (generation)
+select
+	1
+where
+	not exists (select * from ingest_state);
+
+-- permissions
+alter table
+	rescan_manifest owner to "${owner}";
+
+alter table
+	rescan_checkpoint owner to "${owner}";
+
+alter table
+	ingest_state owner to "${owner}";
+
+alter view
+	latest_dbentry owner to "${owner}";
@@ -0,0 +1,469 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <pqxx/pqxx>
+
+#include "archive-watcher.hpp"
+#include "data-service.hpp"
+#include "db-connection.hpp"
+
+namespace fs = std::filesystem;
+
+// --------------------------------------------------------------------
+
+archive_watcher::archive_watcher(const fs::path &pdb_redo_dir, const WatchOptions &options)
+	: m_pdb_redo_dir(pdb_redo_dir)
+	, m_options(options)
+{
+	// At least one entry per batch, or the ingest thread would never take any
+	m_options.batch_size = std::max<size_t>(m_options.batch_size, 1);
+	m_options.queue_size = std::max<size_t>(m_options.queue_size, 1);
+
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0)
+		throw std::runtime_error(std::string("Could not initialise inotify: ") + strerror(errno));
+}
+
+archive_watcher::~archive_watcher()
+{
+	stop();
+
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+void archive_watcher::start()
+{
+	m_thread = std::thread([this]()
+	{
+		try
+		{
+			run();
+		}
+		catch (const std::exception &ex)
+		{
+			std::cerr << "Watcher stopped: " << ex.what() << std::endl;
+		}
+	});
+}
+
+void archive_watcher::stop()
+{
+	m_stop = true;
+	m_cv.notify_all();
+
+	if (m_thread.joinable() and m_thread.get_id() != std::this_thread::get_id())
+		m_thread.join();
+}
+
+// --------------------------------------------------------------------
+
+int archive_watcher::add_watch(const fs::path &dir, DirType type)
+{
+	uint32_t mask = type == DirType::Version
+		? IN_CLOSE_WRITE | IN_MOVED_TO
+		: IN_CREATE | IN_MOVED_TO;
+
+	int wd = inotify_add_watch(m_fd, dir.c_str(), mask | IN_ONLYDIR);
+	if (wd < 0)
+	{
+		if (errno == ENOSPC)
+			throw std::runtime_error("Out of inotify watches, increase fs.inotify.max_user_watches");
+
+		// The directory may have been removed already
+		if (errno != ENOENT and errno != ENOTDIR)
+			std::cerr << "Could not watch " << dir << ": " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	m_watches[wd] = { dir, type };
+	return wd;
+}
+
+void archive_watcher::scan(const fs::path &dir, DirType type, bool initial)
+{
+	std::error_code ec;
+
+	switch (type)
+	{
+		case DirType::Root:
+			for (fs::directory_iterator l1(dir, ec); not ec and l1 != fs::directory_iterator(); l1.increment(ec))
+			{
+				if (not l1->is_directory() or l1->path().filename().string().length() != 2)
+					continue;
+
+				add_watch(l1->path(), DirType::Shard);
+				scan(l1->path(), DirType::Shard, initial);
+			}
+			break;
+
+		case DirType::Shard:
+			for (fs::directory_iterator l2(dir, ec); not ec and l2 != fs::directory_iterator(); l2.increment(ec))
+			{
+				if (not l2->is_directory())
+					continue;
+
+				scan(l2->path(), DirType::Entry, initial);
+			}
+			break;
+
+		case DirType::Entry:
+			// Once an attic exists, there's no need to watch the entry directory itself
+			if (fs::is_directory(dir / "attic", ec))
+			{
+				add_watch(dir / "attic", DirType::Attic);
+				scan(dir / "attic", DirType::Attic, initial);
+			}
+			else
+				add_watch(dir, DirType::Entry);
+			break;
+
+		case DirType::Attic:
+			for (fs::directory_iterator l3(dir, ec); not ec and l3 != fs::directory_iterator(); l3.increment(ec))
+			{
+				if (not l3->is_directory())
+					continue;
+
+				// Watch first, then test, to avoid missing a versions.json written in between
+				int wd = add_watch(l3->path(), DirType::Version);
+
+				auto versions = l3->path() / "versions.json";
+				if (not fs::exists(versions, ec))
+					continue;
+
+				// At startup, versions completed before the watcher started are left to the
+				// incremental rescan done first, their directories need no watch
+				if (initial and fs::last_write_time(versions, ec) < m_started)
+				{
+					if (wd >= 0)
+						inotify_rm_watch(m_fd, wd);
+					continue;
+				}
+
+				schedule(l3->path(), wd);
+			}
+			break;
+
+		case DirType::Version:
+			break;
+	}
+}
+
+// --------------------------------------------------------------------
+
+void archive_watcher::process_event(const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		std::cerr << "inotify event queue overflow, a rescan will be done" << std::endl;
+
+		std::unique_lock lock(m_mutex);
+		m_rescan = true;
+		m_cv.notify_all();
+		return;
+	}
+
+	auto wi = m_watches.find(event->wd);
+	if (wi == m_watches.end())
+		return;
+
+	if (event->mask & IN_IGNORED)
+	{
+		m_watches.erase(wi);
+		return;
+	}
+
+	if (event->len == 0)
+		return;
+
+	auto &[dir, type] = wi->second;
+	fs::path path = dir / event->name;
+	bool is_dir = event->mask & IN_ISDIR;
+
+	switch (type)
+	{
+		case DirType::Root:
+			if (is_dir and path.filename().string().length() == 2)
+			{
+				add_watch(path, DirType::Shard);
+				scan(path, DirType::Shard, false);
+			}
+			break;
+
+		case DirType::Shard:
+			if (is_dir)
+				scan(path, DirType::Entry, false);
+			break;
+
+		case DirType::Entry:
+			if (is_dir and path.filename() == "attic")
+			{
+				inotify_rm_watch(m_fd, event->wd);
+
+				add_watch(path, DirType::Attic);
+				scan(path, DirType::Attic, false);
+			}
+			break;
+
+		case DirType::Attic:
+			if (is_dir)
+			{
+				int wd = add_watch(path, DirType::Version);
+
+				if (fs::exists(path / "versions.json"))
+					schedule(path, wd);
+			}
+			break;
+
+		case DirType::Version:
+			// Changes to data.json postpone the import as well
+			if (path.filename() == "versions.json" or
+				(path.filename() == "data.json" and fs::exists(dir / "versions.json")))
+			{
+				schedule(dir, event->wd);
+			}
+			break;
+	}
+}
+
+void archive_watcher::schedule(const fs::path &dir, int wd)
+{
+	std::unique_lock lock(m_mutex);
+
+	auto due = std::chrono::steady_clock::now() + m_options.delay;
+
+	auto pi = m_pending.find(dir);
+	if (pi != m_pending.end())
+	{
+		pi->second.due = due;
+		if (wd >= 0)
+			pi->second.wd = wd;
+		return;
+	}
+
+	// Apply back pressure, the kernel will queue events in the mean time
+	m_cv.wait(lock, [this]() { return m_stop or m_pending.size() < m_options.queue_size; });
+
+	m_pending.emplace(dir, Pending{ due, wd });
+	m_cv.notify_all();
+}
+
+// --------------------------------------------------------------------
+
+void archive_watcher::run()
+{
+	m_started = fs::file_time_type::clock::now();
+
+	// Entries added while nobody was watching are picked up by an incremental rescan
+	m_rescan = true;
+
+	// The initial scan schedules new entries, so the queue must be emptied already
+	std::thread ingest_thread(&archive_watcher::ingest, this);
+
+	try
+	{
+		add_watch(m_pdb_redo_dir, DirType::Root);
+		scan(m_pdb_redo_dir, DirType::Root, true);
+
+		std::cout << "Watching " << m_watches.size() << " directories in " << m_pdb_redo_dir << std::endl;
+
+		alignas(struct inotify_event) char buffer[64 * 1024];
+
+		while (not m_stop)
+		{
+			struct pollfd pfd = { m_fd, POLLIN, 0 };
+
+			int r = poll(&pfd, 1, 1000);
+			if (r < 0 and errno != EINTR)
+				throw std::runtime_error(std::string("Error polling inotify: ") + strerror(errno));
+
+			if (r <= 0)
+				continue;
+
+			for (;;)
+			{
+				auto len = read(m_fd, buffer, sizeof(buffer));
+				if (len <= 0)
+					break;
+
+				for (char *p = buffer; p < buffer + len;)
+				{
+					auto event = reinterpret_cast<const struct inotify_event *>(p);
+					process_event(event);
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+	}
+	catch (...)
+	{
+		m_stop = true;
+		m_cv.notify_all();
+		ingest_thread.join();
+		throw;
+	}
+
+	ingest_thread.join();
+}
+
+void archive_watcher::ingest()
+{
+	auto &ds = data_service::instance();
+
+	ds.load_dictionaries();
+
+	auto report_error = [](const std::string &pdb_id, const std::string &hash, const std::exception &ex)
+	{
+		std::cerr << "Error importing " << pdb_id << '/' << hash << std::endl
+				  << ex.what() << std::endl;
+	};
+
+	while (not m_stop)
+	{
+		std::vector<std::tuple<fs::path, int>> due;
+		bool rescan = false;
+
+		{
+			std::unique_lock lock(m_mutex);
+
+			auto now = std::chrono::steady_clock::now();
+			auto next = now + std::chrono::seconds(1);
+
+			for (auto pi = m_pending.begin(); pi != m_pending.end();)
+			{
+				if (pi->second.due <= now and due.size() < m_options.batch_size)
+				{
+					due.emplace_back(pi->first, pi->second.wd);
+					pi = m_pending.erase(pi);
+					continue;
+				}
+
+				if (pi->second.due < next)
+					next = pi->second.due;
+				++pi;
+			}
+
+			std::swap(rescan, m_rescan);
+
+			if (due.empty() and not rescan)
+			{
+				m_cv.wait_until(lock, next);
+				continue;
+			}
+
+			// there's room in the queue again
+			m_cv.notify_all();
+		}
+
+		if (rescan)
+		{
+			// Events were lost or the watcher was not running, the manifest makes sure only
+			// changed directories are scanned. This runs inside the server, keep it small and quiet.
+			RescanOptions options;
+			options.threads = 2;
+			options.writer_threads = 1;
+			options.queue_size = m_options.queue_size;
+			options.batch_size = m_options.batch_size;
+			options.checkpoint = false;
+			options.report = false;
+			ds.rescan(options);
+		}
+
+		std::vector<std::tuple<std::string, std::string>> keys;
+
+		for (auto &[dir, wd] : due)
+		{
+			// The hash directory is complete, stop watching it
+			if (wd >= 0)
+				inotify_rm_watch(m_fd, wd);
+
+			std::string hash = dir.filename().string();
+			std::string pdb_id = dir.parent_path().parent_path().filename().string();
+
+			keys.emplace_back(pdb_id, hash);
+		}
+
+		// Look up the whole batch at once, rather than an entry at a time. When
+		// that fails, the entries are left to the next rescan, like any failed import.
+		std::set<std::tuple<std::string, std::string>> existing;
+
+		try
+		{
+			existing = ds.exists(keys);
+		}
+		catch (const pqxx::broken_connection &ex)
+		{
+			db_connection::instance().reset();
+			std::cerr << "Error checking for existing entries: " << ex.what() << std::endl;
+			continue;
+		}
+		catch (const std::exception &ex)
+		{
+			std::cerr << "Error checking for existing entries: " << ex.what() << std::endl;
+			continue;
+		}
+
+		std::vector<EntryData> batch;
+
+		for (auto &[pdb_id, hash] : keys)
+		{
+			if (existing.count({ pdb_id, hash }))
+				continue;
+
+			try
+			{
+				batch.emplace_back(ds.read_entry(pdb_id, hash));
+			}
+			catch (const pqxx::broken_connection &ex)
+			{
+				db_connection::instance().reset();
+				report_error(pdb_id, hash, ex);
+			}
+			catch (const std::exception &ex)
+			{
+				report_error(pdb_id, hash, ex);
+			}
+		}
+
+		if (not batch.empty())
+		{
+			auto n = batch.size();
+
+			ds.flush_batch(batch, report_error);
+
+			std::cout << "Processed " << n << " new entries" << std::endl;
+		}
+	}
+}
@@ -0,0 +1,119 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// --------------------------------------------------------------------
+
+struct WatchOptions
+{
+	std::chrono::seconds delay{ 5 };	///< Wait this long after the last change to an entry before importing it
+	size_t batch_size = 250;			///< The maximum number of entries to write in one transaction
+	size_t queue_size = 1000;			///< The maximum number of entries waiting to be imported
+};
+
+// --------------------------------------------------------------------
+/// \brief Watch the pdb-redo-dir using inotify and import new entries as they appear
+///
+/// New attic/<hash> directories are picked up as soon as their versions.json file
+/// is written. Entries added while the watcher was not running are imported by an
+/// incremental rescan at startup. Since each directory needs a watch of its own,
+/// the system wide limit in fs.inotify.max_user_watches should exceed the number
+/// of PDB IDs.
+
+class archive_watcher
+{
+  public:
+	archive_watcher(const std::filesystem::path &pdb_redo_dir, const WatchOptions &options);
+	~archive_watcher();
+
+	archive_watcher(const archive_watcher &) = delete;
+	archive_watcher &operator=(const archive_watcher &) = delete;
+
+	/// \brief Watch for and import new entries until stop() is called
+	void run();
+
+	/// \brief Call run() in a background thread
+	void start();
+
+	/// \brief Stop watching, waits for the current batch to finish
+	void stop();
+
+  private:
+	enum class DirType
+	{
+		Root,	///< The pdb-redo-dir itself
+		Shard,	///< The two letter directories
+		Entry,	///< A PDB ID directory that does not contain an attic (yet)
+		Attic,	///< An attic directory
+		Version	///< A hash directory in an attic without a versions.json file (yet)
+	};
+
+	int add_watch(const std::filesystem::path &dir, DirType type);
+	void scan(const std::filesystem::path &dir, DirType type, bool initial);
+	void process_event(const struct inotify_event *event);
+
+	/// \brief Queue the hash directory \a dir for import, blocks when the queue is full
+	void schedule(const std::filesystem::path &dir, int wd);
+
+	void ingest();
+
+	std::filesystem::path m_pdb_redo_dir;
+	WatchOptions m_options;
+	int m_fd = -1;
+	std::filesystem::file_time_type m_started;	///< The start of the initial scan
+	std::atomic<bool> m_stop = false;
+	std::thread m_thread;
+
+	struct Watch
+	{
+		std::filesystem::path path;
+		DirType type;
+	};
+
+	std::unordered_map<int, Watch> m_watches;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+
+	struct Pending
+	{
+		std::chrono::steady_clock::time_point due;
+		int wd;		///< The watch on the hash directory, if any
+	};
+
+	std::map<std::filesystem::path, Pending> m_pending;
+	bool m_rescan = false;	///< Events were missed, an incremental rescan is needed
+};
@@ -0,0 +1,146 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include <pqxx/pqxx>
+
+#include "bitmap-index.hpp"
+#include "db-connection.hpp"
+
+// --------------------------------------------------------------------
+
+void bitmap_index::start_load(uint64_t generation)
+{
+	m_loader.load("the bitmap index", m_mutex, m_data, [this, generation]() { return load(generation); });
+}
+
+std::unique_ptr<bitmap_index::Data> bitmap_index::load(uint64_t generation)
+{
+	std::unique_ptr<Data> data(new Data);
+	data->generation = generation;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	tx.exec0("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY");
+
+	// In id order, so the values are appended to the bitmaps
+	for (const auto &[id, name, version] :
+		tx.stream<int, std::string, std::optional<std::string>>("SELECT es.dbentry_id, s.name, s.version FROM dbentry_software es JOIN software s ON s.id = es.software_id ORDER BY es.dbentry_id"))
+	{
+		data->software[{ name, version }].add(id);
+	}
+
+	for (const auto &[id, name, value] :
+		tx.stream<int, std::string, bool>("SELECT pb.dbentry_id, p.name, pb.value FROM dbentry_property_boolean pb JOIN property p ON p.id = pb.property_id ORDER BY pb.dbentry_id"))
+	{
+		data->booleans[{ name, value }].add(id);
+	}
+
+	tx.commit();
+
+	return data;
+}
+
+// --------------------------------------------------------------------
+
+void bitmap_index::add(const std::vector<EntryData> &entries, const std::vector<int> &ids, uint64_t generation)
+{
+	std::unique_lock lock(m_mutex);
+
+	// When a change was missed, the next query triggers a reload
+	if (not m_data or m_data->generation + 1 != generation)
+		return;
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		for (auto &sw : entries[i].software)
+			m_data->software[sw].add(ids[i]);
+
+		for (auto &[name, value] : entries[i].properties)
+		{
+			if (auto b = std::get_if<bool>(&value))
+				m_data->booleans[{ name, *b }].add(ids[i]);
+		}
+	}
+
+	m_data->generation = generation;
+}
+
+std::optional<roaring_bitmap> bitmap_index::evaluate(const std::vector<Filter> &filters, uint64_t generation)
+{
+	std::shared_lock lock(m_mutex);
+
+	if (not m_data or m_data->generation < generation)
+	{
+		lock.unlock();
+		start_load(generation);
+		return {};
+	}
+
+	std::vector<const roaring_bitmap *> bitmaps;
+
+	for (auto &filter : filters)
+	{
+		const roaring_bitmap *bitmap = nullptr;
+
+		if (filter.type == FilterType::Software)
+		{
+			std::optional<std::string> version;
+			if (filter.value != "undefined")
+				version = filter.value;
+
+			auto i = m_data->software.find({ filter.subject, version });
+			if (i != m_data->software.end())
+				bitmap = &i->second;
+		}
+		else
+		{
+			auto i = m_data->booleans.find({ filter.subject, filter.value == "true" });
+			if (i != m_data->booleans.end())
+				bitmap = &i->second;
+		}
+
+		if (bitmap == nullptr)
+			return roaring_bitmap{};
+
+		bitmaps.push_back(bitmap);
+	}
+
+	if (bitmaps.empty())
+		return {};
+
+	// Start with the smallest, the result can only get smaller
+	std::sort(bitmaps.begin(), bitmaps.end(), [](auto a, auto b) { return a->cardinality() < b->cardinality(); });
+
+	roaring_bitmap result = *bitmaps.front();
+	for (size_t i = 1; i < bitmaps.size() and not result.empty(); ++i)
+		result &= *bitmaps[i];
+
+	return result;
+}
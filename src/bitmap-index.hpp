@@ -0,0 +1,83 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "bitmap.hpp"
+#include "data-service.hpp"
+
+// --------------------------------------------------------------------
+/// \brief Compressed bitmaps of dbentry ids per software name and version
+/// and per boolean property value.
+///
+/// Software and boolean filters are resolved by intersecting these
+/// bitmaps, the database only has to apply the remaining filters to the
+/// resulting ids. Like the column store, the index is loaded in the
+/// background on first use and is valid for one ingest generation.
+
+class bitmap_index
+{
+  public:
+	bitmap_index() = default;
+
+	bitmap_index(const bitmap_index &) = delete;
+	bitmap_index &operator=(const bitmap_index &) = delete;
+
+	/// \brief Return the ids of the entries matching all \a filters, these
+	/// should be software filters or filters on boolean properties.
+	///
+	/// Returns an empty optional when the index is not loaded or older than
+	/// \a generation, a (re)load is started in that case.
+	std::optional<roaring_bitmap> evaluate(const std::vector<Filter> &filters, uint64_t generation);
+
+	/// \brief Add the newly committed \a entries with database ids \a ids, that
+	/// were written in ingest generation \a generation
+	void add(const std::vector<EntryData> &entries, const std::vector<int> &ids, uint64_t generation);
+
+  private:
+	struct Data
+	{
+		uint64_t generation = 0;
+		std::map<std::tuple<std::string, std::optional<std::string>>, roaring_bitmap> software;
+		std::map<std::tuple<std::string, bool>, roaring_bitmap> booleans;
+	};
+
+	void start_load(uint64_t generation);
+	std::unique_ptr<Data> load(uint64_t generation);
+
+	std::shared_mutex m_mutex;
+	std::unique_ptr<Data> m_data;
+
+	background_job m_loader;
+};
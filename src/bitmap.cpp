@@ -0,0 +1,204 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include "bitmap.hpp"
+
+// --------------------------------------------------------------------
+
+bool roaring_bitmap::Container::contains(uint16_t low) const
+{
+	if (is_bitset())
+		return bits[low / 64] & (uint64_t(1) << (low % 64));
+
+	return std::binary_search(array.begin(), array.end(), low);
+}
+
+void roaring_bitmap::Container::add(uint16_t low)
+{
+	if (is_bitset())
+	{
+		auto &word = bits[low / 64];
+		auto bit = uint64_t(1) << (low % 64);
+		if ((word & bit) == 0)
+		{
+			word |= bit;
+			++cardinality;
+		}
+		return;
+	}
+
+	// Appending is the common case
+	if (array.empty() or array.back() < low)
+		array.push_back(low);
+	else
+	{
+		auto i = std::lower_bound(array.begin(), array.end(), low);
+		if (*i == low)
+			return;
+		array.insert(i, low);
+	}
+
+	++cardinality;
+
+	if (cardinality > kArrayMax)
+		to_bitset();
+}
+
+void roaring_bitmap::Container::to_bitset()
+{
+	bits.assign(kBitsetWords, 0);
+	for (auto low : array)
+		bits[low / 64] |= uint64_t(1) << (low % 64);
+
+	array.clear();
+	array.shrink_to_fit();
+}
+
+void roaring_bitmap::Container::to_array()
+{
+	array.clear();
+	array.reserve(cardinality);
+
+	for (size_t w = 0; w < bits.size(); ++w)
+	{
+		for (auto word = bits[w]; word != 0; word &= word - 1)
+			array.push_back(uint16_t(w * 64 + __builtin_ctzll(word)));
+	}
+
+	bits.clear();
+	bits.shrink_to_fit();
+}
+
+// --------------------------------------------------------------------
+
+void roaring_bitmap::add(uint32_t v)
+{
+	uint16_t key = v >> 16;
+
+	auto i = m_containers.end();
+	if (m_containers.empty() or m_containers.back().key < key)
+		i = m_containers.insert(m_containers.end(), Container{ key });
+	else
+	{
+		i = std::lower_bound(m_containers.begin(), m_containers.end(), key,
+			[](const Container &c, uint16_t k) { return c.key < k; });
+		if (i == m_containers.end() or i->key != key)
+			i = m_containers.insert(i, Container{ key });
+	}
+
+	i->add(v & 0xffff);
+}
+
+bool roaring_bitmap::contains(uint32_t v) const
+{
+	uint16_t key = v >> 16;
+
+	auto i = std::lower_bound(m_containers.begin(), m_containers.end(), key,
+		[](const Container &c, uint16_t k) { return c.key < k; });
+
+	return i != m_containers.end() and i->key == key and i->contains(v & 0xffff);
+}
+
+size_t roaring_bitmap::cardinality() const
+{
+	size_t result = 0;
+	for (auto &c : m_containers)
+		result += c.cardinality;
+	return result;
+}
+
+void roaring_bitmap::intersect(Container &a, const Container &b)
+{
+	if (a.is_bitset() and b.is_bitset())
+	{
+		a.cardinality = 0;
+		for (size_t w = 0; w < kBitsetWords; ++w)
+		{
+			a.bits[w] &= b.bits[w];
+			a.cardinality += __builtin_popcountll(a.bits[w]);
+		}
+
+		if (a.cardinality <= kArrayMax)
+			a.to_array();
+	}
+	else if (a.is_bitset())
+	{
+		// The result is at most as large as the array in b
+		std::vector<uint16_t> result;
+		for (auto low : b.array)
+		{
+			if (a.contains(low))
+				result.push_back(low);
+		}
+
+		a.bits.clear();
+		a.bits.shrink_to_fit();
+		a.array = std::move(result);
+		a.cardinality = a.array.size();
+	}
+	else if (b.is_bitset())
+	{
+		a.array.erase(std::remove_if(a.array.begin(), a.array.end(),
+			[&b](uint16_t low) { return not b.contains(low); }), a.array.end());
+		a.cardinality = a.array.size();
+	}
+	else
+	{
+		std::vector<uint16_t> result;
+		std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), std::back_inserter(result));
+		a.array = std::move(result);
+		a.cardinality = a.array.size();
+	}
+}
+
+roaring_bitmap &roaring_bitmap::operator&=(const roaring_bitmap &b)
+{
+	std::vector<Container> result;
+
+	auto ai = m_containers.begin();
+	auto bi = b.m_containers.begin();
+
+	while (ai != m_containers.end() and bi != b.m_containers.end())
+	{
+		if (ai->key < bi->key)
+			++ai;
+		else if (bi->key < ai->key)
+			++bi;
+		else
+		{
+			intersect(*ai, *bi);
+			if (ai->cardinality > 0)
+				result.emplace_back(std::move(*ai));
+			++ai;
+			++bi;
+		}
+	}
+
+	m_containers = std::move(result);
+	return *this;
+}
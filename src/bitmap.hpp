@@ -0,0 +1,108 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// --------------------------------------------------------------------
+/// \brief A compressed bitmap of 32 bit values, in the style of Roaring.
+///
+/// Values are grouped by their upper 16 bits into containers. A container
+/// holds either a sorted array of the lower 16 bits, when there are at
+/// most kArrayMax values, or a plain bitset of 65536 bits otherwise.
+
+class roaring_bitmap
+{
+  public:
+	/// \brief Add \a v, adding values in increasing order is fastest
+	void add(uint32_t v);
+
+	/// \brief Return true if \a v is in this bitmap
+	bool contains(uint32_t v) const;
+
+	/// \brief The number of values in this bitmap
+	size_t cardinality() const;
+
+	bool empty() const { return m_containers.empty(); }
+
+	/// \brief Keep only the values that are also in \a b
+	roaring_bitmap &operator&=(const roaring_bitmap &b);
+
+	friend roaring_bitmap operator&(roaring_bitmap a, const roaring_bitmap &b)
+	{
+		return a &= b;
+	}
+
+	/// \brief Call \a f for each value, in increasing order
+	template <typename F>
+	void for_each(F &&f) const
+	{
+		for (auto &c : m_containers)
+		{
+			uint32_t high = uint32_t(c.key) << 16;
+
+			if (c.is_bitset())
+			{
+				for (size_t w = 0; w < c.bits.size(); ++w)
+				{
+					for (auto word = c.bits[w]; word != 0; word &= word - 1)
+						f(high | uint32_t(w * 64 + __builtin_ctzll(word)));
+				}
+			}
+			else
+			{
+				for (auto low : c.array)
+					f(high | low);
+			}
+		}
+	}
+
+  private:
+	static const size_t kArrayMax = 4096;
+	static const size_t kBitsetWords = 65536 / 64;
+
+	struct Container
+	{
+		uint16_t key;
+		uint32_t cardinality = 0;
+		std::vector<uint16_t> array;	// when not a bitset
+		std::vector<uint64_t> bits;		// kBitsetWords long when a bitset
+
+		bool is_bitset() const { return not bits.empty(); }
+
+		bool contains(uint16_t low) const;
+		void add(uint16_t low);
+		void to_bitset();
+		void to_array();
+	};
+
+	static void intersect(Container &a, const Container &b);
+
+	std::vector<Container> m_containers;	// sorted by key
+};
@@ -0,0 +1,437 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include <pqxx/pqxx>
+
+#include "column-store.hpp"
+#include "db-connection.hpp"
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+const double kNoNumber = std::numeric_limits<double>::quiet_NaN();
+const int8_t kNoBoolean = -1;
+const int32_t kNoString = -1;
+
+/// One bit per entry ordinal, filters clear the bits of the entries that do not match
+class bit_vector
+{
+  public:
+	bit_vector(size_t size)
+		: m_size(size)
+		, m_words((size + 63) / 64, ~uint64_t(0))
+	{
+		if (size % 64)
+			m_words.back() = (uint64_t(1) << (size % 64)) - 1;
+	}
+
+	bool test(size_t i) const
+	{
+		return m_words[i / 64] & (uint64_t(1) << (i % 64));
+	}
+
+	void clear()
+	{
+		std::fill(m_words.begin(), m_words.end(), 0);
+	}
+
+	/// Keep the entries for which \a pred is true for the value in \a column.
+	/// The inner loop has no branches, allowing the compiler to vectorize it.
+	template <typename T, typename Pred>
+	void retain(const std::vector<T> &column, Pred &&pred)
+	{
+		for (size_t w = 0; w < m_words.size(); ++w)
+		{
+			if (m_words[w] == 0)
+				continue;
+
+			auto begin = w * 64;
+			auto end = std::min(begin + 64, m_size);
+
+			uint64_t word = 0;
+			for (size_t i = begin; i < end; ++i)
+				word |= uint64_t(pred(column[i])) << (i - begin);
+
+			m_words[w] &= word;
+		}
+	}
+
+	/// Keep only the entries in the sorted list \a ordinals
+	void retain(const std::vector<uint32_t> &ordinals)
+	{
+		std::vector<uint64_t> words(m_words.size(), 0);
+		for (auto o : ordinals)
+			words[o / 64] |= uint64_t(1) << (o % 64);
+
+		for (size_t w = 0; w < m_words.size(); ++w)
+			m_words[w] &= words[w];
+	}
+
+  private:
+	size_t m_size;
+	std::vector<uint64_t> m_words;
+};
+
+} // namespace
+
+// --------------------------------------------------------------------
+
+struct column_store::Data
+{
+	uint64_t generation = 0;
+
+	// Per ordinal
+	std::vector<int> ids;
+	std::vector<std::string> pdb_ids, hashes, dates;
+	std::vector<uint8_t> latest;
+
+	std::unordered_map<int, uint32_t> ordinals;
+	std::unordered_map<std::string, std::vector<uint32_t>> versions;
+
+	// The ordinals in result order
+	std::vector<uint32_t> order;
+
+	struct StringColumn
+	{
+		std::vector<int32_t> codes;
+		std::unordered_map<std::string, int32_t> dictionary;
+	};
+
+	std::unordered_map<std::string, std::vector<double>> numbers;
+	std::unordered_map<std::string, std::vector<int8_t>> booleans;
+	std::unordered_map<std::string, StringColumn> strings;
+
+	// Sorted ordinals per software name and version
+	std::map<std::tuple<std::string, std::optional<std::string>>, std::vector<uint32_t>> software;
+
+	uint32_t append(int id, const std::string &pdb_id, const std::string &hash, const std::string &date, bool is_latest)
+	{
+		uint32_t ordinal = ids.size();
+
+		ids.push_back(id);
+		pdb_ids.push_back(pdb_id);
+		hashes.push_back(hash);
+		dates.push_back(date);
+		latest.push_back(is_latest);
+
+		ordinals.emplace(id, ordinal);
+		versions[pdb_id].push_back(ordinal);
+
+		return ordinal;
+	}
+
+	// Columns are created when the first value is seen, and grown when entries are added
+	void resize_columns()
+	{
+		for (auto &[name, column] : numbers)
+			column.resize(ids.size(), kNoNumber);
+		for (auto &[name, column] : booleans)
+			column.resize(ids.size(), kNoBoolean);
+		for (auto &[name, column] : strings)
+			column.codes.resize(ids.size(), kNoString);
+	}
+
+	void set(const std::string &name, uint32_t ordinal, double value)
+	{
+		auto &column = numbers[name];
+		column.resize(ids.size(), kNoNumber);
+		column[ordinal] = value;
+	}
+
+	void set(const std::string &name, uint32_t ordinal, bool value)
+	{
+		auto &column = booleans[name];
+		column.resize(ids.size(), kNoBoolean);
+		column[ordinal] = value;
+	}
+
+	void set(const std::string &name, uint32_t ordinal, const std::string &value)
+	{
+		auto &column = strings[name];
+		column.codes.resize(ids.size(), kNoString);
+
+		auto code = column.dictionary.emplace(value, column.dictionary.size()).first->second;
+		column.codes[ordinal] = code;
+	}
+
+	/// The latest version has the highest data_time, ties are broken by id as in the database
+	void update_latest(const std::string &pdb_id)
+	{
+		auto &v = versions[pdb_id];
+		if (v.empty())
+			return;
+
+		auto last = *std::max_element(v.begin(), v.end(), [this](uint32_t a, uint32_t b)
+			{ return std::tie(dates[a], ids[a]) < std::tie(dates[b], ids[b]); });
+
+		for (auto o : v)
+			latest[o] = o == last;
+	}
+
+	bool before(uint32_t a, uint32_t b) const
+	{
+		return std::tie(pdb_ids[a], dates[a], hashes[a]) < std::tie(pdb_ids[b], dates[b], hashes[b]);
+	}
+};
+
+// --------------------------------------------------------------------
+
+column_store::column_store(const data_service &ds)
+	: m_ds(ds)
+{
+}
+
+column_store::~column_store()
+{
+}
+
+void column_store::start_load(uint64_t generation)
+{
+	m_loader.load("the column store", m_mutex, m_data, [this, generation]() { return load(generation); });
+}
+
+std::unique_ptr<column_store::Data> column_store::load(uint64_t generation)
+{
+	std::unique_ptr<Data> data(new Data);
+	data->generation = generation;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	// All tables should be read from the same snapshot
+	tx.exec0("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY");
+
+	for (const auto &[id, pdb_id, hash, date, is_latest] :
+		tx.stream<int, std::string, std::string, std::string, bool>("SELECT id, pdb_id, version_hash, data_time, is_latest FROM dbentry"))
+	{
+		data->append(id, pdb_id, hash, date, is_latest);
+	}
+
+	for (const auto &[id, name, value] :
+		tx.stream<int, std::string, double>("SELECT pn.dbentry_id, p.name, pn.value FROM dbentry_property_number pn JOIN property p ON p.id = pn.property_id"))
+	{
+		data->set(name, data->ordinals.at(id), value);
+	}
+
+	for (const auto &[id, name, value] :
+		tx.stream<int, std::string, bool>("SELECT pb.dbentry_id, p.name, pb.value FROM dbentry_property_boolean pb JOIN property p ON p.id = pb.property_id"))
+	{
+		data->set(name, data->ordinals.at(id), value);
+	}
+
+	for (const auto &[id, name, value] :
+		tx.stream<int, std::string, std::string>("SELECT ps.dbentry_id, p.name, ps.value FROM dbentry_property_string ps JOIN property p ON p.id = ps.property_id"))
+	{
+		data->set(name, data->ordinals.at(id), value);
+	}
+
+	for (const auto &[id, name, version] :
+		tx.stream<int, std::string, std::optional<std::string>>("SELECT es.dbentry_id, s.name, s.version FROM dbentry_software es JOIN software s ON s.id = es.software_id"))
+	{
+		data->software[{ name, version }].push_back(data->ordinals.at(id));
+	}
+
+	tx.commit();
+
+	for (auto &[key, ordinals] : data->software)
+		std::sort(ordinals.begin(), ordinals.end());
+
+	data->order.resize(data->ids.size());
+	for (uint32_t i = 0; i < data->order.size(); ++i)
+		data->order[i] = i;
+
+	std::sort(data->order.begin(), data->order.end(), [d = data.get()](uint32_t a, uint32_t b)
+		{ return d->before(a, b); });
+
+	return data;
+}
+
+// --------------------------------------------------------------------
+
+void column_store::add(const std::vector<EntryData> &entries, const std::vector<int> &ids, uint64_t generation)
+{
+	std::unique_lock lock(m_mutex);
+
+	// When a change was missed, the next query triggers a reload
+	if (not m_data or m_data->generation + 1 != generation)
+		return;
+
+	auto &d = *m_data;
+
+	auto first = d.ids.size();
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		auto &entry = entries[i];
+		d.append(ids[i], entry.pdb_id, entry.version_hash, entry.data_time, false);
+	}
+
+	d.resize_columns();
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		uint32_t ordinal = first + i;
+
+		for (auto &[name, value] : entries[i].properties)
+			std::visit([&d, &name = name, ordinal](auto &&v) { d.set(name, ordinal, v); }, value);
+
+		for (auto &sw : entries[i].software)
+		{
+			auto &ordinals = d.software[sw];
+			if (ordinals.empty() or ordinals.back() != ordinal)
+				ordinals.push_back(ordinal);
+		}
+
+		d.update_latest(entries[i].pdb_id);
+	}
+
+	auto mid = d.order.size();
+	for (uint32_t o = first; o < d.ids.size(); ++o)
+		d.order.push_back(o);
+
+	auto before = [&d](uint32_t a, uint32_t b) { return d.before(a, b); };
+	std::sort(d.order.begin() + mid, d.order.end(), before);
+	std::inplace_merge(d.order.begin(), d.order.begin() + mid, d.order.end(), before);
+
+	d.generation = generation;
+}
+
+// --------------------------------------------------------------------
+
+std::optional<std::vector<DbEntry>> column_store::query(const Query &q, uint64_t generation)
+{
+	std::shared_lock lock(m_mutex);
+
+	if (not m_data or m_data->generation < generation)
+	{
+		lock.unlock();
+		start_load(generation);
+		return {};
+	}
+
+	auto &d = *m_data;
+
+	bit_vector selected(d.ids.size());
+
+	if (q.latest)
+		selected.retain(d.latest, [](uint8_t v) { return v != 0; });
+
+	for (auto &filter : q.filters)
+	{
+		if (filter.type == FilterType::Software)
+		{
+			std::optional<std::string> version;
+			if (filter.value != "undefined")
+				version = filter.value;
+
+			auto si = d.software.find({ filter.subject, version });
+			if (si == d.software.end())
+				selected.clear();
+			else
+				selected.retain(si->second);
+
+			continue;
+		}
+
+		switch (m_ds.get_property_type(filter.subject))
+		{
+			case PropertyType::Boolean:
+			{
+				auto ci = d.booleans.find(filter.subject);
+				if (ci == d.booleans.end())
+				{
+					selected.clear();
+					break;
+				}
+
+				int8_t value = filter.value == "true";
+				selected.retain(ci->second, [value](int8_t v) { return v == value; });
+				break;
+			}
+
+			case PropertyType::String:
+			{
+				auto ci = d.strings.find(filter.subject);
+				if (ci == d.strings.end())
+				{
+					selected.clear();
+					break;
+				}
+
+				auto di = ci->second.dictionary.find(filter.value);
+				int32_t code = di == ci->second.dictionary.end() ? kNoString - 1 : di->second;
+
+				if (filter.op == OperatorType::EQ)
+					selected.retain(ci->second.codes, [code](int32_t c) { return c == code; });
+				else
+					selected.retain(ci->second.codes, [code](int32_t c) { return c != kNoString and c != code; });
+				break;
+			}
+
+			case PropertyType::Number:
+			{
+				auto ci = d.numbers.find(filter.subject);
+				if (ci == d.numbers.end())
+				{
+					selected.clear();
+					break;
+				}
+
+				auto &column = ci->second;
+				double x = std::stod(filter.value);
+
+				// Comparisons with NaN, the missing values, are false except for <>
+				switch (filter.op)
+				{
+					case OperatorType::LT: selected.retain(column, [x](double v) { return v < x; }); break;
+					case OperatorType::LE: selected.retain(column, [x](double v) { return v <= x; }); break;
+					case OperatorType::EQ: selected.retain(column, [x](double v) { return v == x; }); break;
+					case OperatorType::GE: selected.retain(column, [x](double v) { return v >= x; }); break;
+					case OperatorType::GT: selected.retain(column, [x](double v) { return v > x; }); break;
+					case OperatorType::NE: selected.retain(column, [x](double v) { return v == v and v != x; }); break;
+					default: throw std::invalid_argument("Invalid operator");
+				}
+				break;
+			}
+		}
+	}
+
+	std::vector<DbEntry> result;
+
+	for (auto o : d.order)
+	{
+		if (selected.test(o))
+			result.emplace_back(DbEntry{ d.pdb_ids[o], d.hashes[o], d.dates[o] });
+	}
+
+	return result;
+}
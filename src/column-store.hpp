@@ -0,0 +1,83 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data-service.hpp"
+
+// --------------------------------------------------------------------
+/// \brief An in-memory copy of the entries and their properties, stored
+/// column wise, that can evaluate a Query without using the database.
+///
+/// Each entry gets an ordinal, each property a dense column indexed by
+/// this ordinal. Filters are evaluated by scanning a column and clearing
+/// the bits of the entries that do not match in a bit vector.
+///
+/// The store is loaded in the background on first use and is valid for
+/// one ingest generation. Entries inserted by this process are added
+/// directly, changes made by other processes result in a reload.
+
+class column_store
+{
+  public:
+	column_store(const data_service &ds);
+	~column_store();
+
+	column_store(const column_store &) = delete;
+	column_store &operator=(const column_store &) = delete;
+
+	/// \brief Return all entries matching \a q, ordered by pdb_id, data_time and version_hash
+	///
+	/// Returns an empty optional when the store is not loaded or older than
+	/// \a generation, a (re)load is started in that case.
+	std::optional<std::vector<DbEntry>> query(const Query &q, uint64_t generation);
+
+	/// \brief Add the newly committed \a entries with database ids \a ids, that
+	/// were written in ingest generation \a generation
+	void add(const std::vector<EntryData> &entries, const std::vector<int> &ids, uint64_t generation);
+
+  private:
+	struct Data;
+
+	void start_load(uint64_t generation);
+	std::unique_ptr<Data> load(uint64_t generation);
+
+	const data_service &m_ds;
+
+	std::shared_mutex m_mutex;
+	std::unique_ptr<Data> m_data;
+
+	background_job m_loader;
+};
@@ -24,10 +24,22 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <date/date.h>
 
@@ -44,8 +56,14 @@
 
 #include "mrsrc.hpp"
 
+#include "bitmap-index.hpp"
+#include "column-store.hpp"
 #include "data-service.hpp"
 #include "db-connection.hpp"
+#include "entry-reader.hpp"
+#include "entry-stream.hpp"
+#include "property-table.hpp"
+#include "query-stats.hpp"
 #include "utilities.hpp"
 
 namespace fs = std::filesystem;
@@ -62,88 +80,95 @@ data_service::data_service()
 
 	m_pdb_redo_dir = config.get("pdb-redo-dir");
 
-	// the data.json schema
-	mrsrc::istream schema_s("data.json.schema");
-	if (not schema_s)
-		throw std::runtime_error("Missing resource");
+	if (auto cache_size = config.get<size_t>("query-cache-size"); cache_size > 0)
+		m_query_cache.reset(new query_cache(cache_size * 1024 * 1024));
 
-	zeep::json::element schema;
-	parse_json(schema_s, schema);
+	// The column store also answers the filters covered by the bitmap index
+	if (config.has("column-store"))
+		m_column_store.reset(new column_store(*this));
+	else
+		m_bitmap_index.reset(new bitmap_index);
 
-	auto prop_schema = schema["definitions"]["Properties"]["properties"];
+	m_query_stats.reset(new query_stats(*this));
 
-	for (auto prop_it = prop_schema.begin(); prop_it != prop_schema.end(); ++prop_it)
-	{
-		auto name = prop_it.key();
-		auto &value = prop_it.value()["type"];
+	// the properties from the data.json schema, compiled in at build time
+	m_properties.reserve(kPropertyCount);
+	for (auto &p : kPropertyTable)
+		m_properties.emplace_back(std::string(p.name), p.type);
+}
 
-		if (value.type() == zeep::json::element::value_type::array)
-		{
-			for (auto &type : value)
-			{
-				auto type_s = type.as<std::string>();
-				if (type_s == "string")
-					m_properties.emplace_back(name, PropertyType::String);
-				else if (type_s == "number")
-					m_properties.emplace_back(name, PropertyType::Number);
-				else if (type_s == "boolean")
-					m_properties.emplace_back(name, PropertyType::Boolean);
-				else
-					continue;
-				break;
-			}
-		}
-		else if (value.type() == zeep::json::element::value_type::string)
-		{
-			auto type_s = value.as<std::string>();
-			if (type_s == "string")
-				m_properties.emplace_back(name, PropertyType::String);
-			else if (type_s == "number")
-				m_properties.emplace_back(name, PropertyType::Number);
-			else if (type_s == "boolean")
-				m_properties.emplace_back(name, PropertyType::Boolean);
-		}
-		
-		// if (not m_prop_types.count(name))
-		// 	throw std::runtime_error("Property " + name + " has unknown type");
-	}
+data_service::~data_service()
+{
 }
 
 // --------------------------------------------------------------------
 
 PropertyType data_service::get_property_type(const std::string &name) const
 {
-	for (auto &p : m_properties)
-	{
-		if (p.name == name)
-			return p.type;
-	}
+	if (auto ordinal = find_property(name); ordinal >= 0)
+		return kPropertyTable[ordinal].type;
 
 	std::throw_with_nested(std::runtime_error("Undefined property " + name));
 }
 
-std::vector<Property> data_service::get_properties() const
+const std::vector<Property> &data_service::get_properties() const
 {
 	return m_properties;
 }
 
 // --------------------------------------------------------------------
 
-std::vector<Software> data_service::get_software() const
+std::shared_ptr<const std::vector<Software>> data_service::get_software()
+{
+	auto generation = current_generation();
+
+	std::shared_ptr<const SoftwareList> list;
+
+	{
+		std::unique_lock lock(m_software_mutex);
+		list = m_software;
+	}
+
+	if (not list)
+	{
+		// Only the very first caller waits for the database
+		list = load_software();
+
+		std::unique_lock lock(m_software_mutex);
+		if (not m_software or m_software->generation < list->generation)
+			m_software = list;
+	}
+	else if (list->generation < generation)
+	{
+		// Keep handing out the current snapshot while the next one loads
+		m_software_loader.load("the software list", m_software_mutex, m_software, [this]() { return load_software(); });
+	}
+
+	// The result keeps the list it is part of alive
+	return { list, &list->software };
+}
+
+std::shared_ptr<const data_service::SoftwareList> data_service::load_software()
 {
-	std::vector<Software> result;
+	auto result = std::make_shared<SoftwareList>();
+
+	auto connection = db_connection::instance().acquire_read();
+	pqxx::work tx(connection);
 
-	pqxx::work tx(db_connection::instance());
+	// Before the list itself, so that the list is at least this recent
+	result->generation = tx.query_value<uint64_t>("SELECT generation FROM ingest_state");
+
+	auto &software = result->software;
 
 	for (const auto &[name, version] : tx.stream<std::string,std::optional<std::string>>("SELECT name, version FROM software ORDER BY name, version"))
 	{
-		if (result.empty() or result.back().name != name)
+		if (software.empty() or software.back().name != name)
 		{
-			result.emplace_back(Software{name, { version.value_or("undefined") }});
+			software.emplace_back(Software{name, { version.value_or("undefined") }});
 			continue;
 		}
 
-		result.back().versions.emplace_back(version.value_or("undefined"));
+		software.back().versions.emplace_back(version.value_or("undefined"));
 	}
 
 	return result;
@@ -183,7 +208,11 @@ data_service &data_service::instance()
 
 // --------------------------------------------------------------------
 
-void data_service::reset()
+namespace
+{
+
+/// Execute the SQL script in resource \a name, using the connection options in the config
+void execute_script(const char *name)
 {
 	using namespace std::literals;
 
@@ -215,12 +244,11 @@ void data_service::reset()
 	
 	// --------------------------------------------------------------------
 	
-	// the schema
-	mrsrc::rsrc schema("db-schema.sql");
-	if (not schema)
-		throw std::runtime_error("Missing schema resource");
+	mrsrc::rsrc script(name);
+	if (not script)
+		throw std::runtime_error(std::string("Missing resource ") + name);
 
-	std::string sql(schema.data(), schema.size());
+	std::string sql(script.data(), script.size());
 	if (not dbuser.empty())
 	{
 		std::string::size_type i = 0;
@@ -238,694 +266,2021 @@ void data_service::reset()
 	PQfinish(connection);
 }
 
-void data_service::rescan()
+} // namespace
+
+void data_service::reset()
 {
-	auto &config = mcfp::config::instance();
+	execute_script("db-schema.sql");
+}
 
-	// --------------------------------------------------------------------
+void data_service::upgrade()
+{
+	execute_script("db-upgrade.sql");
+}
 
-	fs::path pdbRedoDir{config.get("pdb-redo-dir")};
+// --------------------------------------------------------------------
+// Rescan is a pipeline of three stages connected by bounded queues. A
+// single thread walks the directories looking for new entries, a pool of
+// threads reads and parses the files of these entries and one or more
+// threads write the parsed entries to the database in batches.
+//
+// The manifest contains, per PDB ID, the last seen modification time of
+// the attic directory and the hashes found in it. When the modification
+// time is unchanged the attic directory is not scanned again.
+//
+// When reconciling, the hashes found on disk for a shard (taken from the
+// manifest for unchanged attic directories) are compared to the entries
+// in the database for that shard once it is done. Entries that no longer
+// exist on disk are removed.
+
+namespace
+{
 
-	size_t n = 0;
-	for (fs::directory_iterator l1(pdbRedoDir); l1 != fs::directory_iterator(); ++l1)
-	{
-		if (l1->is_directory() and l1->path().filename().string().length() == 2)
-			++n;
-	}
+std::string read_file(const fs::path &path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (not file.is_open())
+		throw std::runtime_error("Could not open file " + path.string());
+
+	std::string result(fs::file_size(path), 0);
+	file.read(result.data(), result.size());
+	result.resize(file.gcount());
+
+	return result;
+}
 
-	progress p0("scanning", n);
+/// Wait for the remaining statements in \a pipeline, throwing the error of
+/// the first that failed. Results that are not retrieved would hide errors.
+void drain(pqxx::pipeline &pipeline)
+{
+	while (not pipeline.empty())
+		pipeline.retrieve();
+	pipeline.complete();
+}
 
-	for (fs::directory_iterator l1(pdbRedoDir); l1 != fs::directory_iterator(); ++l1)
+std::string quote_list(pqxx::work &tx, const std::set<std::string> &values)
+{
+	std::ostringstream result;
+	bool first = true;
+	for (auto &value : values)
 	{
-		if (not l1->is_directory() or l1->path().filename().string().length() != 2)
-			continue;
+		if (not first)
+			result << ", ";
+		first = false;
+		result << tx.quote(value);
+	}
+	return result.str();
+}
 
-		for (fs::directory_iterator l2(l1->path()); l2 != fs::directory_iterator(); ++l2)
-		{
-			if (not l2->is_directory())
-				continue;
+/// Lock the PDB IDs in \a pdb_ids for the rest of the transaction. Batches
+/// written concurrently may contain versions of the same entry, so these are
+/// locked before changing any of their rows, in a fixed order to avoid deadlocks.
+void lock_pdb_ids(pqxx::work &tx, pqxx::pipeline &pipeline, const std::set<std::string> &pdb_ids)
+{
+	if (pdb_ids.empty())
+		return;
 
-			std::string pdb_id = l2->path().filename().string();
+	pipeline.insert(R"(SELECT pg_advisory_xact_lock(h)
+				  FROM (SELECT DISTINCT hashtext(p) AS h
+						  FROM unnest(ARRAY[)" + quote_list(tx, pdb_ids) + R"(]::varchar[]) p
+						 ORDER BY h) l)");
+}
 
-			p0.message(pdb_id);
+/// Recompute the is_latest flag for the entries of \a pdb_ids, these must
+/// have been locked using lock_pdb_ids.
+void update_latest(pqxx::work &tx, pqxx::pipeline &pipeline, const std::set<std::string> &pdb_ids)
+{
+	if (pdb_ids.empty())
+		return;
+
+	pipeline.insert(R"(UPDATE dbentry e
+				   SET is_latest = (e.id = l.id)
+				  FROM (SELECT DISTINCT ON (pdb_id) pdb_id, id
+						  FROM dbentry
+						 WHERE pdb_id IN ()" + quote_list(tx, pdb_ids) + R"()
+						 ORDER BY pdb_id, data_time DESC, id DESC) l
+				 WHERE e.pdb_id = l.pdb_id
+				   AND e.is_latest <> (e.id = l.id))");
+}
 
-			fs::path attic = l2->path() / "attic";
+struct ManifestEntry
+{
+	int64_t mtime;
+	std::string hashes;
+};
 
-			if (not fs::is_directory(attic))
-				continue;
+/// The book keeping for a shard, its manifest rows are written once all
+/// its new entries have passed through the pipeline.
+struct ShardJob
+{
+	std::string name;
+	std::vector<std::tuple<std::string, int64_t, std::string>> manifest;
 
-			for (fs::directory_iterator l3(attic); l3 != fs::directory_iterator(); ++l3)
-			{
-				if (not l3->is_directory() or not fs::exists(l3->path() / "versions.json"))
-					continue;
+	// PDB IDs for which one or more entries could not be imported, these
+	// should not be marked as done in the manifest
+	std::mutex mutex;
+	std::set<std::string> failed;
 
-				fs::path entry = l3->path();
-				std::string hash = entry.filename().string();
+	// One for the walker plus one for each entry still in the pipeline
+	std::atomic<size_t> pending = 1;
 
-				if (exists(pdb_id, hash))
-					continue;
+	// Set when all directories in this shard were walked without error
+	bool walked = false;
 
-				try
-				{
-					std::ifstream versions_file(entry / "versions.json");
-					zeep::json::element versions;
-					parse_json(versions_file, versions);
+	// The PDB IDs and pdb_id/hash pairs found on disk, for reconciling
+	std::unordered_set<std::string> pdb_ids;
+	std::unordered_set<std::string> on_disk;
+};
 
-					std::ifstream data_file(entry / "data.json");
-					zeep::json::element data;
-					parse_json(data_file, data);
+struct ReadItem
+{
+	std::shared_ptr<ShardJob> job;
+	std::string pdb_id;
+	std::string hash;
+	fs::path dir;
+};
 
-					insert(pdb_id, hash, data, versions);
-				}
-				catch (const std::exception &ex)
-				{
-					std::cerr << std::endl
-							  << "Error importing " << pdb_id << '/' << hash << std::endl
-							  << ex.what() << std::endl;
-				}
-			}
-		}
+struct WriteItem
+{
+	std::shared_ptr<ShardJob> job;
+	EntryData entry;
+};
 
-		p0.consumed(1);
+class rescan_pipeline
+{
+  public:
+	rescan_pipeline(data_service &ds, const RescanOptions &options, RescanStats &stats, size_t shard_count)
+		: m_ds(ds)
+		, m_options(options)
+		, m_stats(stats)
+		, m_read_queue(options.queue_size)
+		, m_write_queue(options.queue_size)
+	{
+		if (options.report)
+			m_progress.reset(new progress("scanning", shard_count));
 	}
-}
 
-// --------------------------------------------------------------------
+	void run(const std::vector<fs::path> &shards);
 
-bool data_service::exists(const std::string &pdb_id, const std::string &version_hash) const
-{
-	pqxx::work tx(db_connection::instance());
+  private:
+	void walk(const fs::path &shard);
+	void read();
+	void write();
 
-	auto r = tx.exec1(
-		R"(select count(*)
-			 from dbentry
-			where pdb_id = )" + tx.quote(pdb_id) + R"(
-			  and version_hash = )" + tx.quote(version_hash));
+	void release(ShardJob &job);
+	void finish(ShardJob &job);
 
-	tx.commit();
+	// Remove the entries for this shard that are no longer on disk, returns the
+	// statements in \a pipeline whose affected rows are the entries removed
+	std::vector<pqxx::pipeline::query_id> reconcile(pqxx::work &tx, pqxx::pipeline &pipeline, const ShardJob &job);
 
-	return r.front().as<size_t>() == 1;
-}
+	// Wait for \a pipeline, returns the number of entries removed by \a deletes
+	size_t complete(pqxx::pipeline &pipeline, const std::vector<pqxx::pipeline::query_id> &deletes);
 
-// --------------------------------------------------------------------
+	// Report an error, the worker itself continues with the next entry
+	void report_error(const std::string &pdb_id, const std::string &hash, const std::exception &ex);
 
-void data_service::insert(const std::string &pdb_id, const std::string &hash, const zeep::json::element &data, const zeep::json::element &versions)
-{
-	pqxx::work tx(db_connection::instance());
+	data_service &m_ds;
+	const RescanOptions &m_options;
+	RescanStats &m_stats;
+	std::unique_ptr<progress> m_progress;	///< Null when not reporting
 
-	auto &versions_data = versions["data"];
-	auto &properties = data["properties"];
+	std::unordered_map<std::string, ManifestEntry> m_manifest;
 
-	std::optional<std::string> coordinates_revision_date_pdb;
-	if (versions_data["coordinates_revision_date_pdb"].type() == zeep::json::element::value_type::string)
-		coordinates_revision_date_pdb = versions_data["coordinates_revision_date_pdb"].as<std::string>();
-	std::optional<std::string> coordinates_revision_major_mmCIF;
-	if (versions_data["coordinates_revision_major_mmCIF"].type() == zeep::json::element::value_type::string)
-		coordinates_revision_major_mmCIF = versions_data["coordinates_revision_major_mmCIF"].as<std::string>();
-	std::optional<std::string> coordinates_revision_minor_mmCIF;
-	if (versions_data["coordinates_revision_minor_mmCIF"].type() == zeep::json::element::value_type::string)
-		coordinates_revision_minor_mmCIF = versions_data["coordinates_revision_minor_mmCIF"].as<std::string>();
-	auto coordinates_edited = versions_data["coordinates_edited"].as<bool>();
-	auto reflections_revision = versions_data["reflections_revision"].as<std::string>();
-	auto reflections_edited = versions_data["reflections_edited"].as<bool>();
-
-	auto date_dp = properties["TIME"].as<std::string>();
-
-	auto r = tx.exec1(R"(
-		INSERT INTO dbentry (pdb_id, version_hash, coordinates_revision_date_pdb, coordinates_revision_major_mmCIF, coordinates_revision_minor_mmCIF,
-			coordinates_edited, reflections_revision, reflections_edited, data_time)
-		VALUES ()" +
-			 tx.quote(pdb_id) + ", " +
-			 tx.quote(hash) + ", " +
-			 tx.quote(coordinates_revision_date_pdb) + ", " +
-			 tx.quote(coordinates_revision_major_mmCIF) + ", " +
-			 tx.quote(coordinates_revision_minor_mmCIF) + ", " +
-			 tx.quote(coordinates_edited) + ", " +
-			 tx.quote(reflections_revision) + ", " +
-			 tx.quote(reflections_edited) + ", " +
-			 tx.quote(date_dp) + ") RETURNING id");
-
-	auto id = r.at("id").as<int>();
+	// The shards completed by a previous, interrupted rescan
+	std::unordered_set<std::string> m_completed;
 
-	auto &software = versions["software"];
-	for (auto software_it = software.begin(); software_it != software.end(); ++software_it)
-	{
-		auto used = software_it.value()["used"].as<bool>();
-		if (not used)
-			continue;
+	// The entries already in the database per shard, keyed as pdb_id/hash
+	std::unordered_map<std::string, std::unordered_set<std::string>> m_known;
 
-		auto program = software_it.key();
+	blocking_queue<ReadItem> m_read_queue;
+	blocking_queue<WriteItem> m_write_queue;
 
-		std::optional<std::string> version;
-		if (software_it.value()["version"].type() == zeep::json::element::value_type::string)
-		{
-			version = software_it.value()["version"].as<std::string>();
-			if (version == "null")
-				version.reset();
-		}
+	std::mutex m_error_mutex;
+};
+
+void rescan_pipeline::run(const std::vector<fs::path> &shards)
+{
+	{
+		scoped_timer timer(&m_stats.db_load_time);
 
-		int software_id;
+		auto connection = db_connection::instance().acquire();
+		pqxx::work tx(connection);
 
-		try
+		if (not m_options.full)
 		{
-			pqxx::subtransaction txs(tx);
-			auto r = version ?
-				txs.exec1("SELECT id FROM software WHERE name = " + tx.quote(program) + " AND version = " + tx.quote(version)) :
-				txs.exec1("SELECT id FROM software WHERE name = " + tx.quote(program) + " AND version IS NULL");
-			std::tie(software_id) = r.as<int>();
-			txs.commit();
+			for (const auto &[pdb_id, mtime, hashes] : tx.stream<std::string, int64_t, std::string>("SELECT pdb_id, mtime, hashes FROM rescan_manifest"))
+				m_manifest.emplace(pdb_id, ManifestEntry{ mtime, hashes });
 		}
-		catch (const std::exception &ex)
+
+		// Leave the checkpoints alone when not keeping them, they may belong to an interrupted rescan
+		if (m_options.checkpoint)
 		{
-			pqxx::subtransaction txs(tx);
-			auto r = txs.exec1("INSERT INTO software (name, version) VALUES (" + tx.quote(program) + ", " + tx.quote(version) + ") RETURNING id");
-			std::tie(software_id) = r.as<int>();
-			txs.commit();
+			if (m_options.resume)
+			{
+				for (const auto &[shard] : tx.stream<std::string>("SELECT shard FROM rescan_checkpoint"))
+					m_completed.emplace(shard);
+			}
+			else
+				tx.exec0("DELETE FROM rescan_checkpoint");
 		}
-		
-		pqxx::subtransaction txs2(tx);
-		txs2.exec("INSERT INTO dbentry_software (dbentry_id, software_id) VALUES (" + tx.quote(id) + ", " + tx.quote(software_id) + ")");
-		txs2.commit();
+
+		// Load all known entries at once instead of testing each hash separately
+		for (const auto &[pdb_id, hash] : tx.stream<std::string, std::string>("SELECT pdb_id, version_hash FROM dbentry"))
+			m_known[pdb_id.substr(1, 2)].emplace(pdb_id + '/' + hash);
+
+		tx.commit();
 	}
 
-	for (auto property_it = properties.begin(); property_it != properties.end(); ++property_it)
+	auto start_threads = [](size_t n, void (rescan_pipeline::*stage)(), rescan_pipeline *self)
 	{
-		auto name = property_it.key();
-		auto value = property_it.value();
+		std::list<std::thread> threads;
+		for (size_t i = 0; i < std::max<size_t>(n, 1); ++i)
+			threads.emplace_back(stage, self);
+		return threads;
+	};
 
-		if (value.is_null())
+	auto readers = start_threads(m_options.threads ? m_options.threads : std::thread::hardware_concurrency(), &rescan_pipeline::read, this);
+	auto writers = start_threads(m_options.writer_threads, &rescan_pipeline::write, this);
+
+	for (auto &shard : shards)
+		walk(shard);
+
+	m_read_queue.close();
+	for (auto &t : readers)
+		t.join();
+
+	m_write_queue.close();
+	for (auto &t : writers)
+		t.join();
+
+	if (not m_options.reconcile)
+		return;
+
+	// Shard directories that were removed altogether. An empty pdb-redo-dir
+	// is more likely a missing mount than an empty archive.
+	if (shards.empty())
+	{
+		std::cerr << "No shards found, skipping reconciliation" << std::endl;
+		return;
+	}
+
+	std::set<std::string> names;
+	for (auto &shard : shards)
+		names.insert(shard.filename().string());
+
+	for (auto &[name, known] : m_known)
+	{
+		if (names.count(name))
 			continue;
 
-		int property_id;
+		ShardJob job;
+		job.name = name;
 
 		try
 		{
-			pqxx::subtransaction txs(tx);
-			auto r = txs.exec1("SELECT id FROM property WHERE name = " + tx.quote(name));
-			std::tie(property_id) = r.as<int>();
-			txs.commit();
-		}
-		catch (const std::exception &ex)
-		{
-			pqxx::subtransaction txs(tx);
-			auto r = txs.exec1("INSERT INTO property (name) VALUES (" + tx.quote(name) + ") RETURNING id");
-			std::tie(property_id) = r.as<int>();
-			txs.commit();
-		}
+			scoped_timer timer(&m_stats.db_manifest_time);
 
-		pqxx::subtransaction txs(tx);
-		switch (get_property_type(name))
-		{
-			case PropertyType::String:
-				txs.exec("INSERT INTO dbentry_property_string (dbentry_id, property_id, value) VALUES (" + tx.quote(id) + ", " + tx.quote(property_id) + ", " + tx.quote(value.as<std::string>()) + ")");
-				break;
+			auto connection = db_connection::instance().acquire();
+			pqxx::work tx(connection);
+			pqxx::pipeline pipeline(tx);
 
-			case PropertyType::Number:
-				txs.exec("INSERT INTO dbentry_property_number (dbentry_id, property_id, value) VALUES (" + tx.quote(id) + ", " + tx.quote(property_id) + ", " + tx.quote(value.as<long double>()) + ")");
-				break;
+			auto removed = complete(pipeline, reconcile(tx, pipeline, job));
 
-			case PropertyType::Boolean:
-				txs.exec("INSERT INTO dbentry_property_boolean (dbentry_id, property_id, value) VALUES (" + tx.quote(id) + ", " + tx.quote(property_id) + ", " + tx.quote(value.as<bool>()) + ")");
-				break;
+			tx.commit();
 
-			default:
-				std::runtime_error("Error, unknown property type for " + name);
+			if (removed > 0)
+				m_ds.bump_generation();
+		}
+		catch (const pqxx::broken_connection &ex)
+		{
+			db_connection::instance().reset();
+			report_error(job.name, {}, ex);
+		}
+		catch (const std::exception &ex)
+		{
+			report_error(job.name, {}, ex);
 		}
-
-		txs.commit();
 	}
-
-	tx.commit();
-
 }
 
-int data_service::get_software_id(const std::string &program, const std::string &version) const
+void rescan_pipeline::walk(const fs::path &shard)
 {
-	pqxx::work tx(db_connection::instance());
-
-	int result = -1;
+	auto job = std::make_shared<ShardJob>();
+	job->name = shard.filename().string();
 
-	try
-	{
-		auto r = tx.exec1("SELECT id FROM software WHERE name == " + tx.quote(program) + " AND version = " + tx.quote(version));
-		std::tie(result) = r.as<int>();
-	}
-	catch (const std::exception &ex)
+	if (m_completed.count(job->name))
 	{
-		auto r = tx.exec1("INSERT INTO software (name, version) VALUES (" + tx.quote(program) + ", " + tx.quote(version) + "RETURNING id");
-		std::tie(result) = r.as<int>();
+		if (m_progress)
+			m_progress->consumed(1);
+		return;
 	}
-	
-	tx.commit();
 
-	return result;
-}
+	static const std::unordered_set<std::string> kNone;
+	auto ki = m_known.find(job->name);
+	auto &known = ki != m_known.end() ? ki->second : kNone;
 
-// --------------------------------------------------------------------
+	// The time spent waiting for the readers is not counted as walk time
+	auto start = std::chrono::steady_clock::now();
+	int64_t waited = 0;
 
-class ZipWriter
-{
-  public:
-	ZipWriter()
-		: m_s(new std::stringstream)
+	try
 	{
-		m_a = archive_write_new();
-		archive_write_set_format_zip(m_a);
-		archive_write_open(m_a, this, &open_cb, &write_cb, &close_cb);
-	}
+		for (fs::directory_iterator l2(shard); l2 != fs::directory_iterator(); ++l2)
+		{
+			if (not l2->is_directory())
+				continue;
 
-	~ZipWriter()
-	{
-		archive_write_free(m_a);
-	}
+			std::string pdb_id = l2->path().filename().string();
 
-	void add(fs::path file, fs::path name)
-	{
-		bool compressed = file.extension() == ".gz";
-		assert(compressed == (name.extension() == ".gz"));
+			if (m_progress)
+				m_progress->message(pdb_id);
 
-		std::vector<char> data;
+			fs::path attic = l2->path() / "attic";
 
-		if (compressed)
-			name.replace_extension();
+			std::error_code ec;
+			auto mtime = fs::last_write_time(attic, ec).time_since_epoch().count();
+			if (ec)
+				continue;
 
-		gxrio::ifstream in(file);
+			if (m_options.reconcile)
+				job->pdb_ids.insert(pdb_id);
 
-		for (;;)
-		{
-			char buffer[10240];
-			auto n = in.rdbuf()->sgetn(buffer, sizeof(buffer));
+			auto mi = m_manifest.find(pdb_id);
+			if (mi != m_manifest.end() and mi->second.mtime == mtime)
+			{
+				++m_stats.skipped;
 
-			if (n == 0)
-				break;
+				if (m_options.reconcile)
+				{
+					std::istringstream hs(mi->second.hashes);
+					for (std::string hash; hs >> hash;)
+						job->on_disk.insert(pdb_id + '/' + hash);
+				}
 
-			data.insert(data.end(), buffer, buffer + n);
-		}
+				continue;
+			}
 
-		auto entry = archive_entry_new();
-		archive_entry_set_pathname(entry, name.c_str());
-		archive_entry_set_filetype(entry, AE_IFREG);
-		archive_entry_set_perm(entry, 0644);
-		archive_entry_set_size(entry, data.size());
-		archive_write_header(m_a, entry);
+			++m_stats.directories;
 
-		archive_write_data(m_a, data.data(), data.size());
+			std::string hashes;
 
-		archive_entry_free(entry);		
-	}
+			for (fs::directory_iterator l3(attic); l3 != fs::directory_iterator(); ++l3)
+			{
+				if (not l3->is_directory())
+					continue;
 
-	std::istream *finish()
-	{
-		archive_write_close(m_a);
+				std::string hash = l3->path().filename().string();
 
-		return m_s.release();
-	}
+				if (m_options.reconcile)
+					job->on_disk.insert(pdb_id + '/' + hash);
 
-  private:
+				// An entry that is still being written should be looked at again next time
+				if (not fs::exists(l3->path() / "versions.json"))
+				{
+					mtime = 0;
+					continue;
+				}
 
-	static int open_cb(struct archive *a, void *self)
-	{
-		return ARCHIVE_OK;
-	}
+				if (not hashes.empty())
+					hashes += ' ';
+				hashes += hash;
 
-	static la_ssize_t write_cb(struct archive *a, void *self, const void *buffer, size_t length)
-	{
-		return static_cast<ZipWriter*>(self)->write(static_cast<const char*>(buffer), length);
-	}
+				if (known.count(pdb_id + '/' + hash))
+					continue;
 
-	static int close_cb(struct archive *a, void *self)
-	{
-		return ARCHIVE_OK;
-	}
+				++job->pending;
+				++m_stats.found;
+
+				auto wait_start = std::chrono::steady_clock::now();
+				m_read_queue.push(ReadItem{ job, pdb_id, hash, l3->path() });
+				waited += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wait_start).count();
+			}
+
+			job->manifest.emplace_back(pdb_id, mtime, hashes);
+		}
+
+		job->walked = true;
+	}
+	catch (const std::exception &ex)
+	{
+		report_error(job->name, {}, ex);
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	m_stats.walk_time += elapsed - waited;
+	m_stats.wait_time += waited;
+
+	release(*job);
+}
+
+void rescan_pipeline::read()
+{
+	while (auto item = m_read_queue.pop())
+	{
+		try
+		{
+			EntryData entry{ item->pdb_id, item->hash };
+			std::string versions, data;
+
+			{
+				scoped_timer timer(&m_stats.read_time);
+				versions = read_file(item->dir / "versions.json");
+				data = read_file(item->dir / "data.json");
+			}
+
+			{
+				scoped_timer timer(&m_stats.parse_time);
+				extract_versions(versions, entry);
+				extract_data(data, m_ds, entry);
+			}
+
+			scoped_timer timer(&m_stats.wait_time);
+			m_write_queue.push(WriteItem{ item->job, std::move(entry) });
+		}
+		catch (const std::exception &ex)
+		{
+			{
+				std::unique_lock lock(item->job->mutex);
+				item->job->failed.insert(item->pdb_id);
+			}
+
+			report_error(item->pdb_id, item->hash, ex);
+			release(*item->job);
+		}
+	}
+}
+
+void rescan_pipeline::write()
+{
+	std::vector<EntryData> batch;
+	std::vector<std::tuple<std::shared_ptr<ShardJob>, std::string>> owners;
+
+	auto flush = [&]()
+	{
+		if (batch.empty())
+			return;
+
+		std::set<std::string> failed;
+
+		m_ds.flush_batch(batch, [this, &failed](const std::string &pdb_id, const std::string &hash, const std::exception &ex)
+		{
+			failed.insert(pdb_id);
+			report_error(pdb_id, hash, ex);
+		}, &m_stats);
+
+		for (auto &[job, pdb_id] : owners)
+		{
+			if (failed.count(pdb_id))
+			{
+				std::unique_lock lock(job->mutex);
+				job->failed.insert(pdb_id);
+			}
+
+			release(*job);
+		}
+
+		owners.clear();
+	};
+
+	for (;;)
+	{
+		// Write a partial batch rather than wait for more entries
+		auto item = m_write_queue.try_pop();
+		if (not item)
+		{
+			flush();
+
+			item = m_write_queue.pop();
+			if (not item)
+				break;
+		}
+
+		owners.emplace_back(item->job, item->entry.pdb_id);
+		batch.emplace_back(std::move(item->entry));
+
+		if (batch.size() >= m_options.batch_size)
+			flush();
+	}
+
+	flush();
+}
+
+void rescan_pipeline::release(ShardJob &job)
+{
+	if (--job.pending == 0)
+		finish(job);
+}
+
+void rescan_pipeline::finish(ShardJob &job)
+{
+	// All new entries in this shard are now stored, update the manifest
+	// and record the shard as completed in the checkpoint table
+
+	auto &manifest = job.manifest;
+
+	manifest.erase(std::remove_if(manifest.begin(), manifest.end(),
+		[&job](auto &m) { return job.failed.count(std::get<0>(m)); }), manifest.end());
+
+	try
+	{
+		scoped_timer timer(&m_stats.db_manifest_time);
+
+		auto connection = db_connection::instance().acquire();
+		pqxx::work tx(connection);
+
+		// None of these statements depends on the result of another
+		pqxx::pipeline pipeline(tx);
+
+		if (not manifest.empty())
+		{
+			std::ostringstream qs;
+			qs << "INSERT INTO rescan_manifest (pdb_id, mtime, hashes) VALUES ";
+
+			bool first = true;
+			for (auto &[pdb_id, mtime, hashes] : manifest)
+			{
+				if (not first)
+					qs << ", ";
+				first = false;
+
+				qs << '(' << tx.quote(pdb_id) << ", " << mtime << ", " << tx.quote(hashes) << ')';
+			}
+
+			qs << " ON CONFLICT (pdb_id) DO UPDATE SET mtime = excluded.mtime, hashes = excluded.hashes";
+
+			pipeline.insert(qs.str());
+		}
+
+		std::vector<pqxx::pipeline::query_id> deletes;
+		if (job.walked and m_options.reconcile)
+			deletes = reconcile(tx, pipeline, job);
+
+		// A shard with failed entries is not complete, resume has to look at it again
+		if (m_options.checkpoint and job.walked and job.failed.empty())
+			pipeline.insert("INSERT INTO rescan_checkpoint (shard) VALUES (" + tx.quote(job.name) + ") ON CONFLICT DO NOTHING");
+
+		auto removed = complete(pipeline, deletes);
+
+		tx.commit();
+
+		if (removed > 0)
+			m_ds.bump_generation();
+	}
+	catch (const pqxx::broken_connection &ex)
+	{
+		db_connection::instance().reset();
+		report_error(job.name, {}, ex);
+	}
+	catch (const std::exception &ex)
+	{
+		report_error(job.name, {}, ex);
+	}
+
+	if (m_progress)
+		m_progress->consumed(1);
+}
+
+std::vector<pqxx::pipeline::query_id> rescan_pipeline::reconcile(pqxx::work &tx, pqxx::pipeline &pipeline, const ShardJob &job)
+{
+	std::vector<pqxx::pipeline::query_id> deletes;
+
+	auto ki = m_known.find(job.name);
+	if (ki == m_known.end())
+		return deletes;
+
+	std::vector<std::tuple<std::string, std::string>> stale;
+	std::set<std::string> stale_ids, removed_ids;
+
+	for (auto &key : ki->second)
+	{
+		if (job.on_disk.count(key))
+			continue;
+
+		auto s = key.find('/');
+		std::string pdb_id = key.substr(0, s);
+
+		stale.emplace_back(pdb_id, key.substr(s + 1));
+		stale_ids.insert(pdb_id);
+
+		if (not job.pdb_ids.count(pdb_id))
+			removed_ids.insert(pdb_id);
+	}
+
+	// Lock before deleting, writers lock first and then update these rows
+	lock_pdb_ids(tx, pipeline, stale_ids);
+
+	// Delete in chunks, the software and property rows follow by cascade
+	for (size_t i = 0; i < stale.size(); i += m_options.batch_size)
+	{
+		std::ostringstream qs;
+		qs << "DELETE FROM dbentry WHERE (pdb_id, version_hash) IN (";
+
+		auto n = std::min(stale.size(), i + m_options.batch_size);
+		for (size_t j = i; j < n; ++j)
+		{
+			auto &[pdb_id, hash] = stale[j];
+			if (j > i)
+				qs << ", ";
+			qs << '(' << tx.quote(pdb_id) << ", " << tx.quote(hash) << ')';
+		}
+
+		qs << ')';
+
+		deletes.push_back(pipeline.insert(qs.str()));
+	}
+
+	// Another version may now be the latest
+	update_latest(tx, pipeline, stale_ids);
+
+	if (not removed_ids.empty())
+	{
+		std::ostringstream qs;
+		qs << "DELETE FROM rescan_manifest WHERE pdb_id IN (";
+
+		bool first = true;
+		for (auto &pdb_id : removed_ids)
+		{
+			if (not first)
+				qs << ", ";
+			first = false;
+			qs << tx.quote(pdb_id);
+		}
+
+		qs << ')';
+
+		pipeline.insert(qs.str());
+	}
+
+	return deletes;
+}
+
+size_t rescan_pipeline::complete(pqxx::pipeline &pipeline, const std::vector<pqxx::pipeline::query_id> &deletes)
+{
+	size_t removed = 0;
+	for (auto id : deletes)
+		removed += pipeline.retrieve(id).affected_rows();
+
+	drain(pipeline);
+
+	m_stats.removed += removed;
+
+	return removed;
+}
+
+void rescan_pipeline::report_error(const std::string &pdb_id, const std::string &hash, const std::exception &ex)
+{
+	++m_stats.errors;
+
+	std::unique_lock lock(m_error_mutex);
+	std::cerr << std::endl
+			  << "Error importing " << pdb_id;
+	if (not hash.empty())
+		std::cerr << '/' << hash;
+	std::cerr << std::endl
+			  << ex.what() << std::endl;
+}
+
+} // namespace
+
+void data_service::rescan(const RescanOptions &options)
+{
+	// --------------------------------------------------------------------
+	// Collect the two letter shard directories first, these are the units of work
+
+	std::vector<fs::path> shards;
+	for (fs::directory_iterator l1(m_pdb_redo_dir); l1 != fs::directory_iterator(); ++l1)
+	{
+		if (l1->is_directory() and l1->path().filename().string().length() == 2)
+			shards.emplace_back(l1->path());
+	}
+
+	std::sort(shards.begin(), shards.end());
+
+	RescanStats stats;
+	auto start = std::chrono::steady_clock::now();
+
+	{
+		scoped_timer timer(&stats.db_load_time);
+		load_dictionaries();
+	}
+
+	{
+		rescan_pipeline pipeline(*this, options, stats, shards.size());
+		pipeline.run(shards);
+	}
+
+	stats.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (options.report)
+		stats.write_report(std::cout);
+
+	if (not options.stats_json.empty())
+	{
+		std::ofstream file(options.stats_json);
+		if (not file.is_open())
+			throw std::runtime_error("Could not open " + options.stats_json + " for writing");
+		stats.write_json(file);
+	}
+}
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+double seconds(const std::atomic<int64_t> &ns)
+{
+	return ns * 1e-9;
+}
+
+} // namespace
+
+void RescanStats::write_report(std::ostream &os) const
+{
+	auto per_second = wall_time > 0 ? stored / wall_time : 0;
+
+	os << std::fixed << std::setprecision(1)
+	   << "Rescan statistics" << std::endl
+	   << "  attic directories listed:  " << directories << std::endl
+	   << "  attic directories skipped: " << skipped << std::endl
+	   << "  new entries found:         " << found << std::endl
+	   << "  new entries stored:        " << stored << " (" << per_second << " per second)" << std::endl
+	   << "  stale entries removed:     " << removed << std::endl
+	   << "  errors:                    " << errors << std::endl
+	   << "  wall time:                 " << wall_time << "s" << std::endl
+	   << "Time per stage, summed over threads" << std::endl
+	   << "  enumerating directories:   " << seconds(walk_time) << "s" << std::endl
+	   << "  reading files:             " << seconds(read_time) << "s" << std::endl
+	   << "  parsing JSON:              " << seconds(parse_time) << "s" << std::endl
+	   << "  waiting on full queues:    " << seconds(wait_time) << "s" << std::endl
+	   << "Database time, summed over threads" << std::endl
+	   << "  loading:                   " << seconds(db_load_time) << "s" << std::endl
+	   << "  id lookups:                " << seconds(db_lookup_time) << "s" << std::endl
+	   << "  copying rows:              " << seconds(db_copy_time) << "s" << std::endl
+	   << "  commits:                   " << seconds(db_commit_time) << "s" << std::endl
+	   << "  manifest updates:          " << seconds(db_manifest_time) << "s" << std::endl;
+}
+
+void RescanStats::write_json(std::ostream &os) const
+{
+	zeep::json::element stats{
+		{ "directories", directories.load() },
+		{ "skipped", skipped.load() },
+		{ "found", found.load() },
+		{ "stored", stored.load() },
+		{ "removed", removed.load() },
+		{ "errors", errors.load() },
+		{ "wall_time", wall_time },
+		{ "entries_per_second", wall_time > 0 ? stored / wall_time : 0 },
+		{ "stage_time", {
+			{ "walk", seconds(walk_time) },
+			{ "read", seconds(read_time) },
+			{ "parse", seconds(parse_time) },
+			{ "wait", seconds(wait_time) } } },
+		{ "db_time", {
+			{ "load", seconds(db_load_time) },
+			{ "lookup", seconds(db_lookup_time) },
+			{ "copy", seconds(db_copy_time) },
+			{ "commit", seconds(db_commit_time) },
+			{ "manifest", seconds(db_manifest_time) } } }
+	};
+
+	os << stats << std::endl;
+}
+
+void data_service::flush_batch(std::vector<EntryData> &batch, const error_reporter &report_error, RescanStats *stats)
+{
+	if (batch.empty())
+		return;
+
+	try
+	{
+		insert(batch, stats);
+	}
+	catch (const std::exception &ex)
+	{
+		if (dynamic_cast<const pqxx::broken_connection *>(&ex) != nullptr)
+			db_connection::instance().reset();
+
+		// The batch was rolled back as a whole, retry the entries one by one
+		// to find out which one failed and still store the others.
+		for (auto &entry : batch)
+		{
+			try
+			{
+				insert(std::vector<EntryData>{ entry }, stats);
+			}
+			catch (const pqxx::broken_connection &ex)
+			{
+				db_connection::instance().reset();
+				report_error(entry.pdb_id, entry.version_hash, ex);
+			}
+			catch (const std::exception &ex)
+			{
+				report_error(entry.pdb_id, entry.version_hash, ex);
+			}
+		}
+	}
+
+	batch.clear();
+}
+
+// --------------------------------------------------------------------
+
+bool data_service::exists(const std::string &pdb_id, const std::string &version_hash) const
+{
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	auto r = tx.exec1(
+		R"(select count(*)
+			 from dbentry
+			where pdb_id = )" + tx.quote(pdb_id) + R"(
+			  and version_hash = )" + tx.quote(version_hash));
+
+	tx.commit();
+
+	return r.front().as<size_t>() == 1;
+}
+
+std::set<std::tuple<std::string, std::string>> data_service::exists(const std::vector<std::tuple<std::string, std::string>> &entries) const
+{
+	std::set<std::tuple<std::string, std::string>> result;
+
+	if (entries.empty())
+		return result;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	std::ostringstream qs;
+	qs << "SELECT pdb_id, version_hash FROM dbentry WHERE (pdb_id, version_hash) IN (";
+
+	bool first = true;
+	for (auto &[pdb_id, version_hash] : entries)
+	{
+		if (not first)
+			qs << ", ";
+		first = false;
+		qs << '(' << tx.quote(pdb_id) << ", " << tx.quote(version_hash) << ')';
+	}
+
+	qs << ')';
+
+	for (auto const &[pdb_id, version_hash] : tx.stream<std::string, std::string>(qs.str()))
+		result.emplace(pdb_id, version_hash);
+
+	tx.commit();
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+EntryData data_service::read_entry(const std::string &pdb_id, const std::string &hash)
+{
+	EntryData result{ pdb_id, hash };
+
+	extract_versions(read_file(get_path(pdb_id, hash, FileType::VERSIONS)), result);
+	extract_data(read_file(get_path(pdb_id, hash, FileType::DATA)), *this, result);
+
+	return result;
+}
+
+EntryData data_service::make_entry(const std::string &pdb_id, const std::string &hash, const zeep::json::element &data, const zeep::json::element &versions) const
+{
+	EntryData result{ pdb_id, hash };
+
+	auto &versions_data = versions["data"];
+	auto &properties = data["properties"];
+
+	if (versions_data["coordinates_revision_date_pdb"].type() == zeep::json::element::value_type::string)
+		result.coordinates_revision_date_pdb = versions_data["coordinates_revision_date_pdb"].as<std::string>();
+	if (versions_data["coordinates_revision_major_mmCIF"].type() == zeep::json::element::value_type::string)
+		result.coordinates_revision_major_mmCIF = versions_data["coordinates_revision_major_mmCIF"].as<std::string>();
+	if (versions_data["coordinates_revision_minor_mmCIF"].type() == zeep::json::element::value_type::string)
+		result.coordinates_revision_minor_mmCIF = versions_data["coordinates_revision_minor_mmCIF"].as<std::string>();
+	result.coordinates_edited = versions_data["coordinates_edited"].as<bool>();
+	result.reflections_revision = versions_data["reflections_revision"].as<std::string>();
+	result.reflections_edited = versions_data["reflections_edited"].as<bool>();
+
+	result.data_time = properties["TIME"].as<std::string>();
+
+	auto &software = versions["software"];
+	for (auto software_it = software.begin(); software_it != software.end(); ++software_it)
+	{
+		auto used = software_it.value()["used"].as<bool>();
+		if (not used)
+			continue;
+
+		auto program = software_it.key();
+
+		std::optional<std::string> version;
+		if (software_it.value()["version"].type() == zeep::json::element::value_type::string)
+		{
+			version = software_it.value()["version"].as<std::string>();
+			if (version == "null")
+				version.reset();
+		}
+
+		result.software.emplace_back(program, version);
+	}
+
+	for (auto property_it = properties.begin(); property_it != properties.end(); ++property_it)
+	{
+		auto name = property_it.key();
+		auto &value = property_it.value();
+
+		if (value.is_null())
+			continue;
+
+		switch (get_property_type(name))
+		{
+			case PropertyType::String:
+				result.properties.emplace_back(name, value.as<std::string>());
+				break;
+
+			case PropertyType::Number:
+				result.properties.emplace_back(name, value.as<double>());
+				break;
+
+			case PropertyType::Boolean:
+				result.properties.emplace_back(name, value.as<bool>());
+				break;
+		}
+	}
+
+	return result;
+}
+
+void data_service::insert(const std::string &pdb_id, const std::string &hash, const zeep::json::element &data, const zeep::json::element &versions)
+{
+	insert(std::vector<EntryData>{ make_entry(pdb_id, hash, data, versions) });
+}
+
+void data_service::insert(const std::vector<EntryData> &entries, RescanStats *stats)
+{
+	if (entries.empty())
+		return;
+
+	// Resolve the software and property ids before starting the transaction,
+	// new ones are committed right away by the dictionary.
+
+	std::map<std::tuple<std::string, std::optional<std::string>>, int> software_ids;
+	std::map<std::string, int> property_ids;
+
+	{
+		scoped_timer timer(stats ? &stats->db_lookup_time : nullptr);
+
+		for (auto &entry : entries)
+		{
+			for (auto &sw : entry.software)
+			{
+				if (not software_ids.count(sw))
+					software_ids[sw] = get_software_id(std::get<0>(sw), std::get<1>(sw));
+			}
+
+			for (auto &[name, value] : entry.properties)
+			{
+				if (not property_ids.count(name))
+					property_ids[name] = get_property_id(name);
+			}
+		}
+	}
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	std::vector<int> ids;
+
+	{
+		scoped_timer timer(stats ? &stats->db_copy_time : nullptr);
+
+		// --------------------------------------------------------------------
+		// Reserve the dbentry ids up front, COPY cannot return them
+
+		ids.reserve(entries.size());
+
+		for (auto [id] : tx.stream<int>("SELECT nextval('dbentry_id_seq') FROM generate_series(1, " + std::to_string(entries.size()) + ")"))
+			ids.push_back(id);
+
+		assert(ids.size() == entries.size());
+
+		// --------------------------------------------------------------------
+
+		auto entry_stream = pqxx::stream_to::table(tx, { "dbentry" },
+			{ "id", "pdb_id", "version_hash", "coordinates_revision_date_pdb", "coordinates_revision_major_mmcif", "coordinates_revision_minor_mmcif",
+				"coordinates_edited", "reflections_revision", "reflections_edited", "data_time" });
+
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			auto &entry = entries[i];
+
+			entry_stream.write_values(ids[i], entry.pdb_id, entry.version_hash,
+				entry.coordinates_revision_date_pdb, entry.coordinates_revision_major_mmCIF, entry.coordinates_revision_minor_mmCIF,
+				entry.coordinates_edited, entry.reflections_revision, entry.reflections_edited, entry.data_time);
+		}
+
+		entry_stream.complete();
+
+		auto software_stream = pqxx::stream_to::table(tx, { "dbentry_software" }, { "dbentry_id", "software_id" });
+
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			std::set<int> seen;
+			for (auto &sw : entries[i].software)
+			{
+				auto software_id = software_ids[sw];
+				if (seen.insert(software_id).second)
+					software_stream.write_values(ids[i], software_id);
+			}
+		}
+
+		software_stream.complete();
+
+		// Only one COPY can be active at a time, so write the properties per type
+
+		auto property_stream = [&](const char *table, size_t type_index)
+		{
+			auto s = pqxx::stream_to::table(tx, { table }, { "dbentry_id", "property_id", "value" });
+
+			for (size_t i = 0; i < entries.size(); ++i)
+			{
+				for (auto &[name, value] : entries[i].properties)
+				{
+					if (value.index() != type_index)
+						continue;
+
+					std::visit([&s, id = ids[i], property_id = property_ids[name]](auto &&v)
+						{ s.write_values(id, property_id, v); }, value);
+				}
+			}
+
+			s.complete();
+		};
+
+		property_stream("dbentry_property_string", 0);
+		property_stream("dbentry_property_number", 1);
+		property_stream("dbentry_property_boolean", 2);
+
+		std::set<std::string> pdb_ids;
+		for (auto &entry : entries)
+			pdb_ids.insert(entry.pdb_id);
+
+		pqxx::pipeline pipeline(tx);
+		lock_pdb_ids(tx, pipeline, pdb_ids);
+		update_latest(tx, pipeline, pdb_ids);
+		drain(pipeline);
+	}
+
+	{
+		scoped_timer timer(stats ? &stats->db_commit_time : nullptr);
+		tx.commit();
+	}
+
+	if (stats != nullptr)
+		stats->stored += entries.size();
+
+	auto generation = bump_generation();
+
+	if (m_column_store)
+		m_column_store->add(entries, ids, generation);
+
+	if (m_bitmap_index)
+		m_bitmap_index->add(entries, ids, generation);
+}
+
+void data_service::load_dictionaries()
+{
+	std::unique_lock lock(m_dictionary_mutex);
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	// Fetch both tables in one round trip
+	pqxx::pipeline pipeline(tx);
+	auto software = pipeline.insert("SELECT id, name, version FROM software");
+	auto properties = pipeline.insert("SELECT id, name FROM property");
+
+	m_software_ids.clear();
+	for (const auto &[id, name, version] : pipeline.retrieve(software).iter<int, std::string, std::optional<std::string>>())
+		m_software_ids.emplace(std::make_tuple(name, version), id);
+
+	m_property_ids.clear();
+	for (const auto &[id, name] : pipeline.retrieve(properties).iter<int, std::string>())
+		m_property_ids.emplace(name, id);
+
+	pipeline.complete();
+
+	tx.commit();
+}
+
+int data_service::get_software_id(const std::string &program, const std::optional<std::string> &version)
+{
+	auto key = std::make_tuple(program, version);
+
+	std::shared_lock lock(m_dictionary_mutex);
+
+	auto i = m_software_ids.find(key);
+	if (i != m_software_ids.end())
+		return i->second;
+
+	lock.unlock();
+
+	std::unique_lock ulock(m_dictionary_mutex);
+
+	// might have been added by another thread in the mean time
+	i = m_software_ids.find(key);
+	if (i != m_software_ids.end())
+		return i->second;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	// The unique index is on the coalesced version, so NULL versions conflict as well
+	auto r = tx.exec1(R"(INSERT INTO software (name, version) VALUES ()" + tx.quote(program) + ", " + tx.quote(version) + R"()
+				ON CONFLICT (name, (coalesce(version, ''))) DO UPDATE SET name = excluded.name
+				RETURNING id)");
+
+	tx.commit();
+
+	int result = r.front().as<int>();
+	m_software_ids.emplace(std::move(key), result);
+
+	return result;
+}
+
+int data_service::get_property_id(const std::string &name)
+{
+	std::shared_lock lock(m_dictionary_mutex);
+
+	auto i = m_property_ids.find(name);
+	if (i != m_property_ids.end())
+		return i->second;
+
+	lock.unlock();
+
+	std::unique_lock ulock(m_dictionary_mutex);
+
+	i = m_property_ids.find(name);
+	if (i != m_property_ids.end())
+		return i->second;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	auto r = tx.exec1(R"(INSERT INTO property (name) VALUES ()" + tx.quote(name) + R"()
+				ON CONFLICT (name) DO UPDATE SET name = excluded.name
+				RETURNING id)");
+
+	tx.commit();
+
+	int result = r.front().as<int>();
+	m_property_ids.emplace(name, result);
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+class ZipWriter
+{
+  public:
+	ZipWriter()
+		: m_s(new std::stringstream)
+	{
+		m_a = archive_write_new();
+		archive_write_set_format_zip(m_a);
+		archive_write_open(m_a, this, &open_cb, &write_cb, &close_cb);
+	}
+
+	~ZipWriter()
+	{
+		archive_write_free(m_a);
+	}
+
+	void add(fs::path file, fs::path name)
+	{
+		bool compressed = file.extension() == ".gz";
+		assert(compressed == (name.extension() == ".gz"));
+
+		std::vector<char> data;
+
+		if (compressed)
+			name.replace_extension();
+
+		gxrio::ifstream in(file);
+
+		for (;;)
+		{
+			char buffer[10240];
+			auto n = in.rdbuf()->sgetn(buffer, sizeof(buffer));
+
+			if (n == 0)
+				break;
+
+			data.insert(data.end(), buffer, buffer + n);
+		}
+
+		auto entry = archive_entry_new();
+		archive_entry_set_pathname(entry, name.c_str());
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_perm(entry, 0644);
+		archive_entry_set_size(entry, data.size());
+		archive_write_header(m_a, entry);
+
+		archive_write_data(m_a, data.data(), data.size());
+
+		archive_entry_free(entry);		
+	}
+
+	std::istream *finish()
+	{
+		archive_write_close(m_a);
+
+		return m_s.release();
+	}
+
+  private:
+
+	static int open_cb(struct archive *a, void *self)
+	{
+		return ARCHIVE_OK;
+	}
+
+	static la_ssize_t write_cb(struct archive *a, void *self, const void *buffer, size_t length)
+	{
+		return static_cast<ZipWriter*>(self)->write(static_cast<const char*>(buffer), length);
+	}
+
+	static int close_cb(struct archive *a, void *self)
+	{
+		return ARCHIVE_OK;
+	}
 
 	la_ssize_t write(const char *buffer, size_t length)
 	{
-		m_s->write(buffer, length);
-		return length;
+		m_s->write(buffer, length);
+		return length;
+	}
+
+
+	struct archive *m_a;
+	std::unique_ptr<std::stringstream> m_s;
+};
+
+std::tuple<std::istream *, std::string> data_service::get_file(const std::string &id, const std::string &hash, FileType type)
+{
+	fs::path path;
+	std::string file_name = id + '_' + hash + '_';
+
+	std::unique_ptr<std::istream> is;
+
+	switch (type)
+	{
+		case FileType::ZIP:
+		{
+			ZipWriter zw;
+
+			path = get_path(id, hash, FileType::CIF);
+			zw.add(path, file_name + path.filename().string());
+
+			path = get_path(id, hash, FileType::MTZ);
+			zw.add(path, file_name + path.filename().string());
+
+			path = get_path(id, hash, FileType::DATA);
+			zw.add(path, file_name + path.filename().string());
+
+			path = get_path(id, hash, FileType::VERSIONS);
+			zw.add(path, file_name + path.filename().string());
+
+			file_name += "all.zip";
+			is.reset(zw.finish());
+			break;
+		}
+
+		case FileType::CIF:
+			path = get_path(id, hash, FileType::CIF);
+			is.reset(new std::ifstream(path));
+			file_name += path.filename().string();
+			break;
+
+		case FileType::MTZ:
+			path = get_path(id, hash, FileType::MTZ);
+			is.reset(new std::ifstream(path));
+			file_name += path.filename().string();
+			break;
+
+		case FileType::DATA:
+			path = get_path(id, hash, FileType::DATA);
+			is.reset(new std::ifstream(path));
+			file_name += path.filename().string();
+			break;
+
+		case FileType::VERSIONS:
+			path = get_path(id, hash, FileType::VERSIONS);
+			is.reset(new std::ifstream(path));
+			file_name += path.filename().string();
+			break;
+
+	}
+
+	return { is.release(), file_name };
+}
+
+fs::path data_service::get_path(const std::string &pdb_id, const std::string &hash, FileType type)
+{
+	switch (type)
+	{
+		case FileType::CIF:
+			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "final.cif.gz";
+
+		case FileType::MTZ:
+			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "final.mtz.gz";
+
+		case FileType::DATA:
+			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "data.json";
+
+		case FileType::VERSIONS:
+			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "versions.json";
+
+		default:
+			throw std::invalid_argument("zips are special");
+	}
+}
+
+// --------------------------------------------------------------------
+
+// The ingest generation is a database sequence, bumped after each change
+// to the entries. Cached query results are only valid for one generation.
+
+namespace
+{
+
+void raise_to(std::atomic<uint64_t> &a, uint64_t value)
+{
+	auto current = a.load();
+	while (current < value and not a.compare_exchange_weak(current, value))
+		;
+}
+
+} // namespace
+
+uint64_t data_service::bump_generation()
+{
+	// The change itself is already committed, failing here only means
+	// cached results may be stale until the next bump.
+	try
+	{
+		auto connection = db_connection::instance().acquire();
+		pqxx::work tx(connection);
+		auto generation = tx.query_value<uint64_t>("UPDATE ingest_state SET generation = generation + 1 RETURNING generation");
+		tx.commit();
+
+		raise_to(m_generation, generation);
+
+		return generation;
+	}
+	catch (const pqxx::broken_connection &ex)
+	{
+		db_connection::instance().reset();
+		std::cerr << "Could not update the ingest generation: " << ex.what() << std::endl;
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << "Could not update the ingest generation: " << ex.what() << std::endl;
+	}
+
+	return 0;
+}
+
+uint64_t data_service::current_generation()
+{
+	using namespace std::chrono;
+
+	// Other processes, like rescan, bump the generation as well. Look at
+	// the database at most once per second.
+	auto now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+	auto checked = m_generation_checked.load();
+
+	if (now - checked >= 1000 and m_generation_checked.compare_exchange_strong(checked, now))
+	{
+		auto connection = db_connection::instance().acquire();
+		pqxx::work tx(connection);
+		raise_to(m_generation, tx.query_value<uint64_t>("SELECT generation FROM ingest_state"));
+		tx.commit();
+	}
+
+	return m_generation;
+}
+
+// --------------------------------------------------------------------
+// Queries are compiled into a statement with bind parameters. The filters
+// are sorted first so that the same kind of query always results in the
+// same statement text, allowing it to be prepared once per connection.
+//
+// Results are ordered by pdb_id, data_time and version_hash, which is
+// unique. A cursor holds these three values for the last entry of a page,
+// the next page starts after it using the matching index.
+
+namespace
+{
+
+const char *sql_operator(OperatorType op)
+{
+	switch (op)
+	{
+		case OperatorType::LT: return "<";
+		case OperatorType::LE: return "<=";
+		case OperatorType::EQ: return "=";
+		case OperatorType::GE: return ">=";
+		case OperatorType::GT: return ">";
+		case OperatorType::NE: return "<>";
+		default: throw std::invalid_argument("Invalid operator");
+	}
+}
+
+const char kCursorSeparator = '/';
+
+std::string make_cursor(const DbEntry &e)
+{
+	return e.pdb_id + kCursorSeparator + e.date + kCursorSeparator + e.version_hash;
+}
+
+/// PDB IDs and version hashes consist of letters, digits, dashes and underscores
+bool is_valid_name(const std::string &name)
+{
+	return not name.empty() and std::all_of(name.begin(), name.end(), [](unsigned char ch)
+		{ return std::isalnum(ch) or ch == '-' or ch == '_'; });
+}
+
+/// A date in YYYY-MM-DD format
+bool is_valid_date(const std::string &text)
+{
+	if (text.length() != 10 or text[4] != '-' or text[7] != '-')
+		return false;
+
+	for (auto i : { 0, 1, 2, 3, 5, 6, 8, 9 })
+	{
+		if (not std::isdigit(static_cast<unsigned char>(text[i])))
+			return false;
 	}
 
+	date::year_month_day ymd{ date::year(std::stoi(text.substr(0, 4))),
+		date::month(std::stoi(text.substr(5, 2))), date::day(std::stoi(text.substr(8, 2))) };
 
-	struct archive *m_a;
-	std::unique_ptr<std::stringstream> m_s;
+	return ymd.ok();
+}
+
+/// The cursor is passed in by the client, anything unexpected is a bad request
+std::tuple<std::string, std::string, std::string> parse_cursor(const std::string &cursor)
+{
+	auto s1 = cursor.find(kCursorSeparator);
+	auto s2 = s1 == std::string::npos ? s1 : cursor.find(kCursorSeparator, s1 + 1);
+
+	if (s2 == std::string::npos)
+		throw zeep::http::bad_request;
+
+	std::tuple<std::string, std::string, std::string> result{
+		cursor.substr(0, s1), cursor.substr(s1 + 1, s2 - s1 - 1), cursor.substr(s2 + 1) };
+
+	auto &[pdb_id, date, hash] = result;
+	if (not (is_valid_name(pdb_id) and is_valid_date(date) and is_valid_name(hash)))
+		throw zeep::http::bad_request;
+
+	return result;
+}
+
+class query_compiler
+{
+  public:
+	/// \brief Compile \a q, when \a ids is set the result is restricted to these dbentry ids.
+	/// When \a stats is not null, it is used to put the most selective filter first.
+	query_compiler(const data_service &ds, const Query &q, const std::optional<std::vector<int>> &ids = {}, const query_stats *stats = nullptr);
+
+	/// \brief The statement returning a page of entries, binds \a offset and \a limit
+	std::string select(int64_t offset, std::optional<int64_t> limit);
+
+	/// \brief The statement returning the page of entries following \a cursor, binds the cursor and \a limit
+	std::string select_after(const std::string &cursor, std::optional<int64_t> limit);
+
+	/// \brief The statement returning all entries, followed by the values of properties \a fields
+	std::string select_all(const data_service &ds, const std::vector<std::string> &fields);
+
+	/// \brief The statement returning the number of entries
+	std::string count() const
+	{
+		return "select count(*) from " + m_from + where();
+	}
+
+	const pqxx::params &params() const { return m_params; }
+
+  private:
+	template <typename T>
+	std::string bind(T &&value)
+	{
+		m_params.append(std::forward<T>(value));
+		return '$' + std::to_string(++m_param_count);
+	}
+
+	std::string where(const std::string &condition = {}) const;
+
+	std::string m_from, m_filter;
+	pqxx::params m_params;
+	size_t m_param_count = 0;
 };
 
-std::tuple<std::istream *, std::string> data_service::get_file(const std::string &id, const std::string &hash, FileType type)
+query_compiler::query_compiler(const data_service &ds, const Query &q, const std::optional<std::vector<int>> &ids, const query_stats *stats)
 {
-	fs::path path;
-	std::string file_name = id + '_' + hash + '_';
+	m_from = q.latest ? "latest_dbentry e" : "dbentry e";
 
-	std::unique_ptr<std::istream> is;
+	auto filters = q.filters;
+	std::sort(filters.begin(), filters.end(), [](const Filter &a, const Filter &b)
+		{ return std::tie(a.type, a.subject, a.op) < std::tie(b.type, b.subject, b.op); });
 
-	switch (type)
+	// The most selective filter goes first, it drives the query
+	if (stats != nullptr and filters.size() > 1)
 	{
-		case FileType::ZIP:
-		{
-			ZipWriter zw;
+		std::vector<std::tuple<double, size_t>> order;
+		for (size_t i = 0; i < filters.size(); ++i)
+			order.emplace_back(stats->selectivity(filters[i]), i);
 
-			path = get_path(id, hash, FileType::CIF);
-			zw.add(path, file_name + path.filename().string());
+		std::stable_sort(order.begin(), order.end());
 
-			path = get_path(id, hash, FileType::MTZ);
-			zw.add(path, file_name + path.filename().string());
+		std::vector<Filter> sorted;
+		for (auto &[selectivity, i] : order)
+			sorted.push_back(filters[i]);
+		std::swap(filters, sorted);
+	}
 
-			path = get_path(id, hash, FileType::DATA);
-			zw.add(path, file_name + path.filename().string());
+	std::ostringstream qs;
 
-			path = get_path(id, hash, FileType::VERSIONS);
-			zw.add(path, file_name + path.filename().string());
+	// The first filter returns the candidate entries, the others are
+	// semi-joins testing each candidate
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		auto &filter = filters[i];
+		auto alias = 'f' + std::to_string(i);
 
-			file_name += "all.zip";
-			is.reset(zw.finish());
-			break;
+		if (i == 0)
+			qs << "e.id in (select " << alias << ".dbentry_id from ";
+		else
+			qs << " and exists (select 1 from ";
+
+		switch (filter.type)
+		{
+			case FilterType::Software:
+				qs << "dbentry_software_view " << alias << " where ";
+				break;
+
+			case FilterType::Data:
+				switch (ds.get_property_type(filter.subject))
+				{
+					case PropertyType::Boolean: qs << "dbentry_property_boolean_view " << alias << " where "; break;
+					case PropertyType::String: qs << "dbentry_property_string_view " << alias << " where "; break;
+					case PropertyType::Number: qs << "dbentry_property_number_view " << alias << " where "; break;
+				}
+				break;
 		}
 
-		case FileType::CIF:
-			path = get_path(id, hash, FileType::CIF);
-			is.reset(new std::ifstream(path));
-			file_name += path.filename().string();
-			break;
+		if (i > 0)
+			qs << alias << ".dbentry_id = f0.dbentry_id and ";
 
-		case FileType::MTZ:
-			path = get_path(id, hash, FileType::MTZ);
-			is.reset(new std::ifstream(path));
-			file_name += path.filename().string();
-			break;
+		qs << alias << ".name = " << bind(filter.subject) << " and " << alias;
 
-		case FileType::DATA:
-			path = get_path(id, hash, FileType::DATA);
-			is.reset(new std::ifstream(path));
-			file_name += path.filename().string();
-			break;
+		switch (filter.type)
+		{
+			case FilterType::Software:
+				if (filter.value == "undefined")
+					qs << ".version is null";
+				else
+					qs << ".version = " << bind(filter.value);
+				break;
 
-		case FileType::VERSIONS:
-			path = get_path(id, hash, FileType::VERSIONS);
-			is.reset(new std::ifstream(path));
-			file_name += path.filename().string();
-			break;
+			case FilterType::Data:
+				switch (ds.get_property_type(filter.subject))
+				{
+					case PropertyType::Boolean:
+						qs << ".value = " << bind(filter.value == "true");
+						break;
+
+					case PropertyType::String:
+						qs << ".value " << (filter.op == OperatorType::EQ ? "=" : "<>") << ' ' << bind(filter.value);
+						break;
+
+					case PropertyType::Number:
+						qs << ".value " << sql_operator(filter.op) << ' ' << bind(std::stod(filter.value));
+						break;
+				}
+				break;
+		}
 
+		if (i > 0)
+			qs << ')';
 	}
 
-	return { is.release(), file_name };
+	if (not filters.empty())
+		qs << ')';
+
+	if (ids)
+		qs << (filters.empty() ? "" : " and ") << "e.id = any(" << bind(*ids) << "::int[])";
+
+	m_filter = qs.str();
 }
 
-fs::path data_service::get_path(const std::string &pdb_id, const std::string &hash, FileType type)
+std::string query_compiler::where(const std::string &condition) const
 {
-	switch (type)
+	if (m_filter.empty() and condition.empty())
+		return {};
+	if (condition.empty())
+		return " where " + m_filter;
+	if (m_filter.empty())
+		return " where " + condition;
+	return " where " + m_filter + " and " + condition;
+}
+
+std::string query_compiler::select(int64_t offset, std::optional<int64_t> limit)
+{
+	return "select e.pdb_id, e.version_hash, e.data_time from " + m_from + where() +
+		   " order by e.pdb_id, e.data_time, e.version_hash offset " + bind(offset) + " limit " + bind(limit);
+}
+
+std::string query_compiler::select_after(const std::string &cursor, std::optional<int64_t> limit)
+{
+	std::string condition;
+
+	if (not cursor.empty())
 	{
-		case FileType::CIF:
-			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "final.cif.gz";
+		auto [pdb_id, date, hash] = parse_cursor(cursor);
+		condition = "(e.pdb_id, e.data_time, e.version_hash) > (" + bind(pdb_id) + ", " + bind(date) + "::date, " + bind(hash) + ")";
+	}
 
-		case FileType::MTZ:
-			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "final.mtz.gz";
+	return "select e.pdb_id, e.version_hash, e.data_time from " + m_from + where(condition) +
+		   " order by e.pdb_id, e.data_time, e.version_hash limit " + bind(limit);
+}
 
-		case FileType::DATA:
-			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "data.json";
+std::string query_compiler::select_all(const data_service &ds, const std::vector<std::string> &fields)
+{
+	std::ostringstream qs;
+	qs << "select e.pdb_id, e.version_hash, e.data_time";
 
-		case FileType::VERSIONS:
-			return m_pdb_redo_dir / pdb_id.substr(1, 2) / pdb_id / "attic" / hash / "versions.json";
+	// An entry has at most one value for a property
+	for (auto &field : fields)
+	{
+		qs << ", (select v.value from ";
 
-		default:
-			throw std::invalid_argument("zips are special");
+		switch (ds.get_property_type(field))
+		{
+			case PropertyType::Boolean: qs << "dbentry_property_boolean_view"; break;
+			case PropertyType::String: qs << "dbentry_property_string_view"; break;
+			case PropertyType::Number: qs << "dbentry_property_number_view"; break;
+		}
+
+		qs << " v where v.dbentry_id = e.id and v.name = " << bind(field) << ')';
 	}
+
+	qs << " from " << m_from << where() << " order by e.pdb_id, e.data_time, e.version_hash";
+
+	return qs.str();
 }
 
-// --------------------------------------------------------------------
+Query software_query(const std::string &program, const std::string &version)
+{
+	return Query{ false, { Filter{ FilterType::Software, program, OperatorType::EQ, version } } };
+}
 
-std::vector<DbEntry> data_service::query_1(const std::string &program, const std::string &version, uint32_t page, uint32_t page_size)
+/// Return a key that is equal for queries that select the same entries:
+/// filters are sorted, duplicates removed and values normalized.
+std::string canonical_query(const data_service &ds, const Query &q)
 {
-	pqxx::work tx(db_connection::instance());
+	std::vector<std::tuple<FilterType, std::string, OperatorType, std::string>> filters;
 
-	std::vector<DbEntry> entries;
+	for (auto &filter : q.filters)
+	{
+		auto op = filter.op;
+		auto value = filter.value;
 
-	std::string version_clause;
-	if (version == "undefined")
-		version_clause = "is null";
-	else
-		version_clause = "= " + tx.quote(version);
+		if (filter.type == FilterType::Software)
+			op = OperatorType::EQ;
+		else
+		{
+			switch (ds.get_property_type(filter.subject))
+			{
+				case PropertyType::Boolean:
+					op = OperatorType::EQ;
+					value = value == "true" ? "true" : "false";
+					break;
+
+				case PropertyType::String:
+					if (op != OperatorType::EQ)
+						op = OperatorType::NE;
+					break;
+
+				case PropertyType::Number:
+				{
+					std::ostringstream vs;
+					vs << std::setprecision(17) << std::stod(value);
+					value = vs.str();
+					break;
+				}
+			}
+		}
+
+		filters.emplace_back(filter.type, filter.subject, op, value);
+	}
+
+	std::sort(filters.begin(), filters.end());
+	filters.erase(std::unique(filters.begin(), filters.end()), filters.end());
 
-	for (auto const& [pdb_id, version_hash, date]:
-		tx.stream<std::string,std::string,std::string>(
-		R"(select e.pdb_id,
-				  e.version_hash,
-				  e.data_time
-			 from dbentry e
-			 join dbentry_software es on es.dbentry_id = e.id
-			 join software s on es.software_id = s.id
-			where s.name = )" + tx.quote(program) + R"(
-			  and s.version )" + version_clause + R"(
-			order by e.pdb_id, e.data_time
-		   offset )" + std::to_string(page * page_size) + R"( rows
-			fetch first )" + std::to_string(page_size) + R"( rows only)"))
+	// length prefixed strings, to avoid ambiguity
+	std::ostringstream ks;
+	ks << (q.latest ? 'L' : 'A');
+	for (auto &[type, subject, op, value] : filters)
 	{
-		entries.emplace_back(DbEntry{ pdb_id, version_hash, date });
+		ks << ' ' << static_cast<int>(type) << static_cast<int>(op)
+		   << ' ' << subject.length() << ':' << subject
+		   << ' ' << value.length() << ':' << value;
 	}
 
-	tx.commit();
+	return ks.str();
+}
 
-	return entries;
+} // namespace
+
+std::vector<DbEntry> data_service::query_1(const std::string &program, const std::string &version, uint32_t page, uint32_t page_size)
+{
+	return query(software_query(program, version), page, page_size);
 }
 
 size_t data_service::count_1(const std::string &program, const std::string &version)
 {
-	pqxx::work tx(db_connection::instance());
+	return count(software_query(program, version));
+}
 
-	std::string version_clause;
-	if (version == "undefined")
-		version_clause = "is null";
-	else
-		version_clause = "= " + tx.quote(version);
+namespace
+{
 
-	auto r = tx.exec1(
-		R"(select count(*)
-			 from dbentry e
-			 join dbentry_software es on es.dbentry_id = e.id
-			 join software s on es.software_id = s.id
-			where s.name = )" + tx.quote(program) + R"(
-			  and s.version )" + version_clause);
+std::optional<int64_t> page_limit(uint32_t page_size)
+{
+	std::optional<int64_t> result;
+	if (page_size < std::numeric_limits<uint32_t>::max())
+		result = page_size;
+	return result;
+}
+
+/// Execute \a sql on \a connection, a lease on the primary or on a replica. When
+/// \a generation is not null, it is set to the generation the result belongs to.
+std::vector<DbEntry> fetch_entries(db_lease connection, const std::string &sql, const pqxx::params &params, uint64_t *generation = nullptr)
+{
+	auto statement = connection.prepared(sql);
+
+	pqxx::work tx(connection);
+
+	// Read first, a change committed in between only makes the result newer than this
+	if (generation)
+		*generation = tx.query_value<uint64_t>("SELECT generation FROM ingest_state");
+
+	std::vector<DbEntry> entries;
+
+	for (auto const &[pdb_id, version_hash, date] :
+		tx.exec_prepared(statement, params).iter<std::string, std::string, std::string>())
+	{
+		DbEntry e{ pdb_id, version_hash, date };
+		e.cursor = make_cursor(e);
+		entries.emplace_back(std::move(e));
+	}
 
 	tx.commit();
 
-	return r.front().as<size_t>();
+	return entries;
 }
 
-std::vector<DbEntry> data_service::query(const Query &q, uint32_t page, uint32_t page_size)
+} // namespace
+
+query_cache::entry_list data_service::cached_result(const Query &q, bool fetch)
 {
-	pqxx::work tx(db_connection::instance());
+	if (not (m_query_cache or m_column_store))
+		return {};
 
-	std::stringstream qs;
-	qs << "select e.pdb_id, e.version_hash, e.data_time"
-	   << "  from " << (q.latest ? "latest_dbentry" : "dbentry") << " e";
-	
-	if (not q.filters.empty())
+	auto generation = current_generation();
+
+	std::string key;
+	if (m_query_cache)
 	{
-		qs << " where id in (";
+		key = canonical_query(*this, q);
 
-		bool first = true;
+		auto cached = m_query_cache->get(key, generation);
+		if (cached and (*cached or not m_column_store))
+			return *cached;
+	}
 
-		for (auto &filter : q.filters)
+	// The column store answers any query, but only once it is loaded
+	if (m_column_store)
+	{
+		if (auto entries = m_column_store->query(q, generation))
 		{
-			if (not first)
-				qs << " intersect ";
-			first = false;
+			for (auto &e : *entries)
+				e.cursor = make_cursor(e);
 
-			switch (filter.type)
-			{
-				case FilterType::Software:
-					qs << "select dbentry_id from dbentry_software_view s where"
-						<< " s.name = " << tx.quote(filter.subject)
-						<< " and s.version ";
-					
-					if (filter.value == "undefined")
-						qs << "is null";
-					else
-						qs << "= " + tx.quote(filter.value);
-					
-					qs << std::endl;
-					break;
-				
-				case FilterType::Data:
-					switch (get_property_type(filter.subject))
-					{
-						case PropertyType::Boolean:
-							qs << "select dbentry_id from dbentry_property_boolean_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value = " << tx.quote(filter.value == "true")
-								<< std::endl;
-							break;
-	
-						case PropertyType::String:
-							qs << "select dbentry_id from dbentry_property_string_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value " << (filter.op == OperatorType::EQ ? "=" : "<>") << tx.quote(filter.value)
-								<< std::endl;
-							break;
-
-						case PropertyType::Number:
-							qs << "select dbentry_id from dbentry_property_number_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value ";
-							
-							switch (filter.op)
-							{
-								case OperatorType::LT:
-									qs << "<";
-									break;
-
-								case OperatorType::LE:
-									qs << "<=";
-									break;
-
-								case OperatorType::EQ:
-									qs << "=";
-									break;
-
-								case OperatorType::GE:
-									qs << ">=";
-									break;
-
-								case OperatorType::GT:
-									qs << ">";
-									break;
-
-								case OperatorType::NE:
-									qs << "<>";
-									break;
-								
-								default:
-									throw std::invalid_argument("Invalid operator");
-							}
-								
-							qs << ' ' << tx.quote(std::stold(filter.value))
-								<< std::endl;
-							break;
-					}
-					break;
-			}
+			query_cache::entry_list result = std::make_shared<const std::vector<DbEntry>>(std::move(*entries));
+
+			if (m_query_cache and result->size() <= m_query_cache->max_result_size())
+				m_query_cache->put(key, generation, result);
+
+			return result;
 		}
+	}
 
-		qs << ')';
+	if (not (m_query_cache and fetch))
+		return {};
+
+	// Fetch one more than fits, to find out if the result is too large
+	auto max_size = m_query_cache->max_result_size();
+
+	Query rq = q;
+	auto ids = plan_query(rq);
+
+	query_compiler qc(*this, rq, ids, m_query_stats.get());
+	auto sql = qc.select(0, max_size + 1);
+
+	// Cached for the generation the replica has reached, the cache drops a
+	// result from a replica lagging behind its current generation
+	uint64_t fetched_generation;
+	auto entries = fetch_entries(db_connection::instance().acquire_read(), sql, qc.params(), &fetched_generation);
+
+	query_cache::entry_list result;
+	if (entries.size() <= max_size)
+		result = std::make_shared<const std::vector<DbEntry>>(std::move(entries));
+
+	m_query_cache->put(key, fetched_generation, result);
+
+	return result;
+}
+
+std::optional<std::vector<int>> data_service::plan_query(Query &q)
+{
+	// Beyond this many ids, passing them to the database costs more than it saves
+	const size_t kMaxIds = 100000;
+
+	auto generation = current_generation();
+
+	m_query_stats->refresh(generation);
+
+	if (not m_bitmap_index)
+		return {};
+
+	std::vector<Filter> indexed, remaining;
+	for (auto &filter : q.filters)
+	{
+		if (filter.type == FilterType::Software or get_property_type(filter.subject) == PropertyType::Boolean)
+			indexed.push_back(filter);
+		else
+			remaining.push_back(filter);
 	}
 
-	qs << "  order by e.pdb_id, e.data_time";
+	if (indexed.empty())
+		return {};
 
-	if (page > 0)
-		qs << " offset " << (page * page_size) << " rows";
-	
-	if (page_size < std::numeric_limits<uint32_t>::max())
-		qs << " fetch first " << page_size << " rows only";
+	auto bitmap = m_bitmap_index->evaluate(indexed, generation);
+	if (not bitmap or bitmap->cardinality() > kMaxIds)
+		return {};
 
-	std::vector<DbEntry> entries;
+	std::vector<int> ids;
+	ids.reserve(bitmap->cardinality());
+	bitmap->for_each([&ids](uint32_t id) { ids.push_back(id); });
+
+	q.filters = std::move(remaining);
+
+	return ids;
+}
+
+std::vector<DbEntry> data_service::query(const Query &q, uint32_t page, uint32_t page_size)
+{
+	if (auto cached = cached_result(q))
+	{
+		auto first = std::min<size_t>(size_t(page) * page_size, cached->size());
+		auto last = std::min<size_t>(first + page_size, cached->size());
+		return { cached->begin() + first, cached->begin() + last };
+	}
+
+	Query rq = q;
+	auto ids = plan_query(rq);
 
-	for (auto const& [pdb_id, version_hash, date]:
-		tx.stream<std::string,std::string,std::string>(qs.str()))
+	query_compiler qc(*this, rq, ids, m_query_stats.get());
+	auto sql = qc.select(int64_t(page) * page_size, page_limit(page_size));
+	return fetch_entries(db_connection::instance().acquire_read(), sql, qc.params());
+}
+
+std::vector<DbEntry> data_service::query_after(const Query &q, const std::string &after, uint32_t page_size)
+{
+	if (auto cached = cached_result(q))
 	{
-		entries.emplace_back(DbEntry{ pdb_id, version_hash, date });
+		auto i = cached->begin();
+
+		// The result is ordered like select_after, so the entries following the cursor
+		// can be found even when the entry it points at was removed since
+		if (not after.empty())
+		{
+			auto key = parse_cursor(after);
+			i = std::upper_bound(cached->begin(), cached->end(), key, [](auto &key, const DbEntry &e)
+				{ return std::tie(std::get<0>(key), std::get<1>(key), std::get<2>(key)) < std::tie(e.pdb_id, e.date, e.version_hash); });
+		}
+
+		auto n = std::min<size_t>(page_size, cached->end() - i);
+		return { i, i + n };
 	}
 
-	tx.commit();
+	Query rq = q;
+	auto ids = plan_query(rq);
 
-	return entries;
+	query_compiler qc(*this, rq, ids, m_query_stats.get());
+	auto sql = qc.select_after(after, page_limit(page_size));
+	return fetch_entries(db_connection::instance().acquire_read(), sql, qc.params());
 }
 
 size_t data_service::count(const Query &q)
 {
-	pqxx::work tx(db_connection::instance());
+	// Counting is cheaper than fetching the result, so only use it when at hand
+	if (auto cached = cached_result(q, false))
+		return cached->size();
 
-	std::stringstream qs;
-	qs << "select count(*)"
-	   << "  from " << (q.latest ? "latest_dbentry" : "dbentry") << " e";
-	
-	if (not q.filters.empty())
+	Query rq = q;
+	auto ids = plan_query(rq);
+
+	// No need to ask the database when the bitmaps did all the work
+	if (ids and rq.filters.empty() and not rq.latest)
+		return ids->size();
+
+	query_compiler qc(*this, rq, ids, m_query_stats.get());
+
+	auto connection = db_connection::instance().acquire_read();
+	auto statement = connection.prepared(qc.count());
+
+	pqxx::work tx(connection);
+
+	auto r = tx.exec_prepared1(statement, qc.params());
+
+	tx.commit();
+
+	return r.front().as<size_t>();
+}
+
+std::unique_ptr<std::istream> data_service::stream_query(const Query &q, const std::string &prefix, const std::string &suffix)
+{
+	return stream_entries(q, {}, false, prefix, suffix);
+}
+
+std::unique_ptr<std::istream> data_service::stream_ndjson(const Query &q, const std::vector<std::string> &fields)
+{
+	return stream_entries(q, fields, true, {}, {});
+}
+
+std::unique_ptr<std::istream> data_service::stream_entries(const Query &q, const std::vector<std::string> &fields,
+	bool ndjson, const std::string &prefix, const std::string &suffix)
+{
+	Query rq = q;
+	auto ids = plan_query(rq);
+
+	query_compiler qc(*this, rq, ids, m_query_stats.get());
+	auto sql = qc.select_all(*this, fields);
+
+	std::vector<PropertyType> types;
+	for (auto &field : fields)
+		types.push_back(get_property_type(field));
+
+	auto write_entry = [fields, types, ndjson](std::ostream &os, const pqxx::row &row)
 	{
-		qs << " where id in (";
+		DbEntry e{ row[0].as<std::string>(), row[1].as<std::string>(), row[2].as<std::string>() };
+		e.cursor = make_cursor(e);
 
-		bool first = true;
+		zeep::json::element je;
+		to_element(je, e);
 
-		for (auto &filter : q.filters)
+		for (size_t i = 0; i < fields.size(); ++i)
 		{
-			if (not first)
-				qs << " intersect ";
-			first = false;
+			auto &properties = je["properties"];
+			auto field = row[int(i + 3)];
 
-			switch (filter.type)
+			if (field.is_null())
+				properties[fields[i]] = {};
+			else
 			{
-				case FilterType::Software:
-					qs << "select dbentry_id from dbentry_software_view s where"
-						<< " s.name = " << tx.quote(filter.subject)
-						<< " and s.version ";
-					
-					if (filter.value == "undefined")
-						qs << "is null";
-					else
-						qs << "= " + tx.quote(filter.value);
-					
-					qs << std::endl;
-					break;
-				
-				case FilterType::Data:
-					switch (get_property_type(filter.subject))
-					{
-						case PropertyType::Boolean:
-							qs << "select dbentry_id from dbentry_property_boolean_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value = " << tx.quote(filter.value == "true")
-								<< std::endl;
-							break;
-	
-						case PropertyType::String:
-							qs << "select dbentry_id from dbentry_property_string_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value " << (filter.op == OperatorType::EQ ? "=" : "<>") << tx.quote(filter.value)
-								<< std::endl;
-							break;
-
-						case PropertyType::Number:
-							qs << "select dbentry_id from dbentry_property_number_view where"
-								<< " name = " << tx.quote(filter.subject)
-								<< " and value ";
-							
-							switch (filter.op)
-							{
-								case OperatorType::LT:
-									qs << "<";
-									break;
-
-								case OperatorType::LE:
-									qs << "<=";
-									break;
-
-								case OperatorType::EQ:
-									qs << "=";
-									break;
-
-								case OperatorType::GE:
-									qs << ">=";
-									break;
-
-								case OperatorType::GT:
-									qs << ">";
-									break;
-
-								case OperatorType::NE:
-									qs << "<>";
-									break;
-								
-								default:
-									throw std::invalid_argument("Invalid operator");
-							}
-								
-							qs << ' ' << tx.quote(std::stold(filter.value))
-								<< std::endl;
-							break;
-					}
-					break;
+				switch (types[i])
+				{
+					case PropertyType::Boolean: properties[fields[i]] = field.as<bool>(); break;
+					case PropertyType::String: properties[fields[i]] = field.as<std::string>(); break;
+					case PropertyType::Number: properties[fields[i]] = field.as<double>(); break;
+				}
 			}
 		}
 
-		qs << ')';
-	}
+		os << je;
 
-	auto r = tx.exec1(qs.str());
-	return r.front().as<size_t>();
-}
+		if (ndjson)
+			os << '\n';
+	};
 
+	return std::make_unique<entry_stream>(db_connection::instance().acquire_read(true),
+		sql, qc.params(), write_entry, prefix, ndjson ? "" : ",", suffix);
+}
@@ -26,8 +26,21 @@
 
 #pragma once
 
+#include <atomic>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <tuple>
+#include <unordered_map>
+#include <variant>
+
 #include <zeep/json/element.hpp>
 
+#include "query-cache.hpp"
 #include "utilities.hpp"
 
 // --------------------------------------------------------------------
@@ -107,15 +120,45 @@ struct DbEntry
 	std::string version_hash;
 	std::string date;
 
+	/// \brief Opaque position of this entry in a query result, pass it as
+	/// \a after to data_service::query_after to get the entries following it
+	std::string cursor;
+
 	template<typename Archive>
 	void serialize(Archive& ar, unsigned long version)
 	{
 		ar & zeep::make_nvp("id", pdb_id)
 		   & zeep::make_nvp("hash", version_hash)
-		   & zeep::make_nvp("date", date);
+		   & zeep::make_nvp("date", date)
+		   & zeep::make_nvp("cursor", cursor);
 	}
 };
 
+/// \brief The values of a PDB-REDO entry that are stored in the database,
+/// extracted from its data.json and versions.json files
+
+struct EntryData
+{
+	using PropertyValue = std::variant<std::string, double, bool>;
+
+	std::string pdb_id;
+	std::string version_hash;
+
+	std::optional<std::string> coordinates_revision_date_pdb;
+	std::optional<std::string> coordinates_revision_major_mmCIF;
+	std::optional<std::string> coordinates_revision_minor_mmCIF;
+	bool coordinates_edited = false;
+	std::string reflections_revision;
+	bool reflections_edited = false;
+	std::string data_time;
+
+	/// \brief The software used, name and version
+	std::vector<std::tuple<std::string, std::optional<std::string>>> software;
+
+	/// \brief The non-null properties, the type of the value follows the property type
+	std::vector<std::tuple<std::string, PropertyValue>> properties;
+};
+
 // --------------------------------------------------------------------
 
 enum class FilterType { Software, Data };
@@ -153,16 +196,75 @@ struct Query
 
 // --------------------------------------------------------------------
 
+struct RescanOptions
+{
+	size_t threads = 0;			///< The number of threads reading new entries, zero means all cores
+	size_t writer_threads = 2;	///< The number of threads writing new entries to the database
+	size_t queue_size = 1000;	///< The maximum number of entries waiting between two stages
+	size_t batch_size = 250;	///< The number of new entries to collect before writing them in one transaction
+	bool full = false;			///< Ignore the manifest and look into every attic directory
+	bool resume = false;		///< Skip the shards completed by a previous rescan
+	bool checkpoint = true;		///< Record the completed shards for resume, off for rescans that cannot be resumed
+	bool reconcile = false;		///< Remove the entries that no longer exist on disk
+	bool report = true;			///< Show the progress and write the statistics to stdout
+	std::string stats_json;		///< When not empty, the file to write the statistics to
+};
+
+/// \brief Instrumentation for rescan, times are in nanoseconds summed over all threads
+
+struct RescanStats
+{
+	std::atomic<size_t> directories = 0;	///< The number of attic directories listed
+	std::atomic<size_t> skipped = 0;		///< The number of attic directories skipped using the manifest
+	std::atomic<size_t> found = 0;			///< The number of new entries found
+	std::atomic<size_t> stored = 0;			///< The number of new entries written to the database
+	std::atomic<size_t> removed = 0;		///< The number of stale entries removed from the database
+	std::atomic<size_t> errors = 0;
+
+	std::atomic<int64_t> walk_time = 0;		///< Enumerating directories
+	std::atomic<int64_t> wait_time = 0;		///< Waiting for room in a full queue
+	std::atomic<int64_t> read_time = 0;		///< Reading data.json and versions.json
+	std::atomic<int64_t> parse_time = 0;	///< Extracting the values from these files
+
+	std::atomic<int64_t> db_load_time = 0;		///< Loading the manifest, known entries and dictionaries
+	std::atomic<int64_t> db_lookup_time = 0;	///< Resolving software and property ids
+	std::atomic<int64_t> db_copy_time = 0;		///< Reserving ids and copying rows
+	std::atomic<int64_t> db_commit_time = 0;	///< Committing batches
+	std::atomic<int64_t> db_manifest_time = 0;	///< Updating the manifest and removing stale entries
+
+	double wall_time = 0;	///< Total duration of the rescan, in seconds
+
+	/// \brief Print a human readable summary
+	void write_report(std::ostream &os) const;
+
+	/// \brief Write the statistics as a JSON object
+	void write_json(std::ostream &os) const;
+};
+
+// --------------------------------------------------------------------
+
+class bitmap_index;
+class column_store;
+class query_stats;
+
 class data_service
 {
   public:
+	~data_service();
+
+	using error_reporter = std::function<void(const std::string &pdb_id, const std::string &hash, const std::exception &ex)>;
+
 	/// \brief Wipe databank if it exists and create new based on info in config
 	static void reset();
 
+	/// \brief Bring the schema of an existing databank up to date, keeping its entries
+	static void upgrade();
+
 	/// \brief Return the singleton instance of data_service, will init one if it doesn't exist.
 	static data_service &instance();
 
-	void rescan();
+	/// \brief Scan the pdb-redo-dir for new entries and insert these into the database
+	void rescan(const RescanOptions &options);
 
 	/// \brief Return the file of type \a type for the hash \a hash returning a tuple containing the istream and name of the download file
 	///
@@ -186,17 +288,44 @@ class data_service
 	/// \brief Insert a new PDB-REDO entry
 	void insert(const std::string &pdb_id, const std::string &hash, const zeep::json::element &data, const zeep::json::element &versions);
 
-	/// \brief Return the id for the software entry with name \a program and version \a version
-	int get_software_id(const std::string &program, const std::string &version) const;
+	/// \brief Insert a batch of new PDB-REDO entries using COPY, in a single transaction
+	///
+	/// When \a stats is not null, the time spent in the database is added to it.
+	void insert(const std::vector<EntryData> &entries, RescanStats *stats = nullptr);
+
+	/// \brief Insert \a batch, retrying the entries one by one when the batch as a whole fails
+	///
+	/// Errors for individual entries are passed to \a report_error, \a batch is cleared afterwards.
+	void flush_batch(std::vector<EntryData> &batch, const error_reporter &report_error, RescanStats *stats = nullptr);
+
+	/// \brief Read the data.json and versions.json files for entry \a pdb_id / \a hash, without building a DOM
+	EntryData read_entry(const std::string &pdb_id, const std::string &hash);
+
+	/// \brief Fill the software and property id dictionaries from the database
+	void load_dictionaries();
+
+	/// \brief Record that entries were added or removed, invalidating cached query results.
+	/// Returns the new generation, or zero when it could not be updated.
+	uint64_t bump_generation();
+
+	/// \brief Extract the values to store for entry \a pdb_id / \a hash from its \a data and \a versions
+	EntryData make_entry(const std::string &pdb_id, const std::string &hash, const zeep::json::element &data, const zeep::json::element &versions) const;
+
+	/// \brief Return the id for the software entry with name \a program and version \a version, creating it when needed
+	int get_software_id(const std::string &program, const std::optional<std::string> &version);
+
+	/// \brief Return the id for the property named \a name, creating it when needed
+	int get_property_id(const std::string &name);
 
 	/// \brief Return the property type for property named \a name
 	PropertyType get_property_type(const std::string &name) const;
 
-	/// \brief Return all Properties
-	std::vector<Property> get_properties() const;
+	/// \brief Return all Properties, these are fixed by the schema
+	const std::vector<Property> &get_properties() const;
 
-	/// \brief Return the list of available programs
-	std::vector<Software> get_software() const;
+	/// \brief Return the list of available programs. This is a snapshot kept in memory, it
+	/// is replaced in the background when the ingest generation changes.
+	std::shared_ptr<const std::vector<Software>> get_software();
 
 	// --------------------------------------------------------------------
 	
@@ -207,10 +336,29 @@ class data_service
 	/// \brief Return true if entry exists.
 	bool exists(const std::string &pdb_id, const std::string &version_hash) const;
 
+	/// \brief Return the subset of \a entries, pairs of PDB ID and version hash, that exist.
+	/// Uses a single statement instead of one round trip per entry.
+	std::set<std::tuple<std::string, std::string>> exists(const std::vector<std::tuple<std::string, std::string>> &entries) const;
+
 	/// \brief Another query
 	std::vector<DbEntry> query(const Query &q, uint32_t page, uint32_t page_size);
+
+	/// \brief Return at most \a page_size entries following the entry with cursor \a after,
+	/// starting at the first entry when \a after is empty. Unlike \a query, the cost does not
+	/// depend on how deep into the result the page is.
+	std::vector<DbEntry> query_after(const Query &q, const std::string &after, uint32_t page_size);
 	size_t count(const Query &q);
 
+	/// \brief Return a stream containing \a prefix, the entries for \a q as JSON objects
+	/// separated by commas and \a suffix. The entries are read from the database while the
+	/// stream is consumed, memory use does not depend on the size of the result.
+	std::unique_ptr<std::istream> stream_query(const Query &q, const std::string &prefix, const std::string &suffix);
+
+	/// \brief Return a stream containing the entries for \a q as newline delimited JSON, read
+	/// from the database while the stream is consumed. The values of the properties in \a fields
+	/// are added to each entry as an object named properties.
+	std::unique_ptr<std::istream> stream_ndjson(const Query &q, const std::vector<std::string> &fields);
+
   private:
 
 	data_service();
@@ -219,8 +367,56 @@ class data_service
 
 	std::filesystem::path get_path(const std::string &pdb_id, const std::string &hash, FileType type);
 
+	/// \brief The complete result for \a q from the query cache or the column store, executing
+	/// the query when needed and \a fetch is set. Returns null when the result should be
+	/// fetched page by page.
+	query_cache::entry_list cached_result(const Query &q, bool fetch = true);
+
+	/// \brief The current ingest generation, also picks up changes made by other processes
+	uint64_t current_generation();
+
+	/// \brief A snapshot of the software list, of the generation the replica it was
+	/// loaded from had reached
+	struct SoftwareList
+	{
+		uint64_t generation;
+		std::vector<Software> software;
+	};
+
+	std::shared_ptr<const SoftwareList> load_software();
+
+	/// \brief Prepare \a q for the query compiler, refreshing the statistics used to order
+	/// the filters and resolving the software and boolean filters using the bitmap index
+	///
+	/// When the bitmap index is used, these filters are removed from \a q and the ids of the
+	/// matching entries are returned.
+	std::optional<std::vector<int>> plan_query(Query &q);
+
+	/// \brief The stream for stream_query and stream_ndjson, the entries are separated by newlines
+	/// when \a ndjson is true and by commas otherwise
+	std::unique_ptr<std::istream> stream_entries(const Query &q, const std::vector<std::string> &fields,
+		bool ndjson, const std::string &prefix, const std::string &suffix);
+
 	static std::unique_ptr<data_service> s_instance;
 
 	std::filesystem::path m_pdb_redo_dir;
 	std::vector<Property> m_properties;
+
+	// name to id dictionaries for the software and property tables
+	std::shared_mutex m_dictionary_mutex;
+	std::map<std::tuple<std::string, std::optional<std::string>>, int> m_software_ids;
+	std::unordered_map<std::string, int> m_property_ids;
+
+	std::unique_ptr<query_cache> m_query_cache;
+	std::unique_ptr<column_store> m_column_store;
+	std::unique_ptr<bitmap_index> m_bitmap_index;
+	std::unique_ptr<query_stats> m_query_stats;
+	std::atomic<uint64_t> m_generation = 0;
+	std::atomic<int64_t> m_generation_checked = 0;	///< Milliseconds on the steady clock
+
+	// The snapshot returned by get_software
+	std::mutex m_software_mutex;
+	std::shared_ptr<const SoftwareList> m_software;
+
+	background_job m_software_loader;
 };
\ No newline at end of file
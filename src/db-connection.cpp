@@ -24,8 +24,15 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sstream>
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <list>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
 
 #include <mcfp/mcfp.hpp>
 
@@ -33,15 +40,428 @@
 
 // --------------------------------------------------------------------
 
+namespace
+{
+
+// The number of distinct statements is small, but do not let it grow unbounded
+const size_t kMaxPrepared = 256;
+
+// Idle connections are tested before reuse when they were not used for this long
+const auto kIdleCheck = std::chrono::seconds(30);
+
+// Connections above the minimum pool size are closed after being idle this long
+const auto kIdleClose = std::chrono::minutes(5);
+
+// The interval for measuring the lag of a replica
+const auto kLagCheck = std::chrono::seconds(5);
+
+/// No connection became available within the pool timeout
+class checkout_timeout : public std::runtime_error
+{
+  public:
+	checkout_timeout()
+		: std::runtime_error("Timeout waiting for a database connection")
+	{
+	}
+};
+
+} // namespace
+
+// --------------------------------------------------------------------
+/// \brief The connections to one server
+
+class connection_pool
+{
+  public:
+	connection_pool(db_connection &owner, const std::string &connection_string, const PoolOptions &options, bool replica);
+	~connection_pool();
+
+	connection_pool(const connection_pool &) = delete;
+	connection_pool &operator=(const connection_pool &) = delete;
+
+	/// \brief Start the background thread, the server forks after init()
+	void start();
+
+	std::unique_ptr<pooled_connection> checkout();
+	void release(std::unique_ptr<pooled_connection> connection);
+
+	void reset();
+
+	/// \brief False for a replica that is unreachable or lagging behind too far, and for
+	/// a replica whose lag was not measured yet
+	bool usable() const
+	{
+		return m_usable;
+	}
+
+	/// \brief Stop using this replica until the next lag check says otherwise
+	void set_unusable(const std::exception &ex);
+
+  private:
+	/// \brief Open a new connection and prepare the known statements on it
+	std::unique_ptr<pooled_connection> open();
+
+	void maintain();
+
+	/// \brief Measure the replication lag, updating m_usable
+	void check_lag();
+
+	db_connection &m_owner;
+	std::string m_connection_string;
+	PoolOptions m_options;
+	bool m_replica;
+	std::atomic<bool> m_usable;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv, m_maintain_cv;
+	std::list<std::unique_ptr<pooled_connection>> m_idle;
+	size_t m_size = 0;		///< The number of open connections, idle or leased
+	bool m_check = false, m_stop = false;
+
+	std::thread m_maintainer;
+};
+
+connection_pool::connection_pool(db_connection &owner, const std::string &connection_string, const PoolOptions &options, bool replica)
+	: m_owner(owner)
+	, m_connection_string(connection_string)
+	, m_options(options)
+	, m_replica(replica)
+	, m_usable(not replica)
+{
+}
+
+connection_pool::~connection_pool()
+{
+	{
+		std::unique_lock lock(m_mutex);
+		m_stop = true;
+		m_maintain_cv.notify_all();
+	}
+
+	if (m_maintainer.joinable())
+		m_maintainer.join();
+}
+
+void connection_pool::reset()
+{
+	// The other connections may have been broken by the same cause
+	std::unique_lock lock(m_mutex);
+	m_check = true;
+	m_maintain_cv.notify_all();
+}
+
+void connection_pool::set_unusable(const std::exception &ex)
+{
+	if (m_usable.exchange(false))
+		std::cerr << "Replica not in use: " << ex.what() << std::endl;
+}
+
+void connection_pool::start()
+{
+	std::unique_lock lock(m_mutex);
+
+	if (not m_maintainer.joinable())
+		m_maintainer = std::thread(&connection_pool::maintain, this);
+}
+
+std::unique_ptr<pooled_connection> connection_pool::checkout()
+{
+	start();
+
+	std::unique_lock lock(m_mutex);
+
+	if (not m_cv.wait_for(lock, m_options.timeout, [this]() { return not m_idle.empty() or m_size < m_options.max_size; }))
+		throw checkout_timeout();
+
+	if (not m_idle.empty())
+	{
+		auto result = std::move(m_idle.front());
+		m_idle.pop_front();
+
+		if (std::chrono::steady_clock::now() - result->last_used < kIdleCheck)
+			return result;
+
+		// Test a connection that was idle for a while, replace it when it is broken
+		lock.unlock();
+
+		try
+		{
+			pqxx::nontransaction(*result->connection).exec("select 1");
+			return result;
+		}
+		catch (const pqxx::failure &)
+		{
+		}
+	}
+	else
+	{
+		++m_size;
+		lock.unlock();
+	}
+
+	try
+	{
+		return open();
+	}
+	catch (...)
+	{
+		lock.lock();
+		--m_size;
+		m_cv.notify_one();
+		throw;
+	}
+}
+
+void connection_pool::release(std::unique_ptr<pooled_connection> connection)
+{
+	std::unique_lock lock(m_mutex);
+
+	if (connection->connection->is_open())
+	{
+		connection->last_used = std::chrono::steady_clock::now();
+
+		// Most recently used first, the ones at the back can be closed when idle too long
+		m_idle.push_front(std::move(connection));
+	}
+	else
+	{
+		--m_size;
+		m_maintain_cv.notify_all();
+	}
+
+	m_cv.notify_one();
+}
+
+std::unique_ptr<pooled_connection> connection_pool::open()
+{
+	std::unique_ptr<pooled_connection> result(new pooled_connection{
+		std::make_unique<pqxx::connection>(m_connection_string), this });
+
+	for (auto &[sql, name] : m_owner.statements())
+	{
+		try
+		{
+			result->connection->prepare(name, sql);
+			result->prepared.emplace(sql, name);
+		}
+		catch (const pqxx::sql_error &ex)
+		{
+			// Not fatal, the statement will be prepared again when it is used
+			std::cerr << "Could not prepare statement: " << ex.what() << std::endl;
+		}
+	}
+
+	result->last_used = std::chrono::steady_clock::now();
+
+	return result;
+}
+
+void connection_pool::check_lag()
+{
+	try
+	{
+		auto connection = checkout();
+
+		// Zero when this is not a standby, or when all WAL received is replayed while
+		// still streaming from the primary. NULL when the WAL receiver is not streaming,
+		// since then the received WAL tells nothing about the primary. The status is
+		// only visible with pg_read_all_stats, without it a running receiver will do.
+		auto lag = pqxx::nontransaction(*connection->connection).query_value<std::optional<double>>(
+			R"(SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0
+						  WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver
+											WHERE coalesce(status, 'streaming') = 'streaming') THEN NULL
+						  WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0
+						  ELSE coalesce(extract(epoch FROM now() - pg_last_xact_replay_timestamp()), 0) END)");
+
+		release(std::move(connection));
+
+		if (not lag.has_value())
+			set_unusable(std::runtime_error("not streaming from the primary"));
+		else if (*lag > m_options.max_lag.count())
+			set_unusable(std::runtime_error("lagging " + std::to_string(*lag) + " seconds behind"));
+		else if (not m_usable.exchange(true))
+			std::cerr << "Replica in use" << std::endl;
+	}
+	catch (const std::exception &ex)
+	{
+		set_unusable(ex);
+	}
+}
+
+void connection_pool::maintain()
+{
+	std::unique_lock lock(m_mutex);
+
+	while (not m_stop)
+	{
+		m_maintain_cv.wait_for(lock, m_replica ? kLagCheck : kIdleCheck,
+			[this]() { return m_stop or m_check or m_size < m_options.min_size; });
+
+		if (m_stop)
+			break;
+
+		bool check_all = std::exchange(m_check, false);
+		auto now = std::chrono::steady_clock::now();
+
+		// Take out the idle connections to test, or to close when there are more than needed
+		std::list<std::unique_ptr<pooled_connection>> idle;
+		for (auto i = m_idle.begin(); i != m_idle.end();)
+		{
+			if (check_all or now - (*i)->last_used >= kIdleCheck)
+			{
+				idle.emplace_back(std::move(*i));
+				i = m_idle.erase(i);
+			}
+			else
+				++i;
+		}
+
+		size_t size = m_size;
+
+		lock.unlock();
+
+		size_t closed = 0;
+		for (auto i = idle.begin(); i != idle.end();)
+		{
+			bool keep = false;
+
+			if (now - (*i)->last_used < kIdleClose or size - closed <= m_options.min_size)
+			{
+				try
+				{
+					pqxx::nontransaction(*(*i)->connection).exec("select 1");
+					keep = true;
+				}
+				catch (const std::exception &)
+				{
+				}
+			}
+
+			if (keep)
+				++i;
+			else
+			{
+				i = idle.erase(i);
+				++closed;
+			}
+		}
+
+		lock.lock();
+
+		m_size -= closed;
+		for (auto &c : idle)
+		{
+			c->last_used = now;
+			m_idle.push_back(std::move(c));
+		}
+
+		// Reconnect up to the minimum size
+		while (not m_stop and m_size < m_options.min_size)
+		{
+			++m_size;
+			lock.unlock();
+
+			std::unique_ptr<pooled_connection> c;
+			try
+			{
+				c = open();
+			}
+			catch (const std::exception &ex)
+			{
+				std::cerr << "Could not connect to the database: " << ex.what() << std::endl;
+			}
+
+			lock.lock();
+
+			if (not c)
+			{
+				--m_size;
+				break;
+			}
+
+			m_idle.push_back(std::move(c));
+		}
+
+		m_cv.notify_all();
+
+		if (m_replica)
+		{
+			lock.unlock();
+			check_lag();
+			lock.lock();
+		}
+
+		// Try again later when connecting failed
+		if (m_size < m_options.min_size)
+			m_maintain_cv.wait_for(lock, kIdleCheck, [this]() { return m_stop; });
+	}
+}
+
+// --------------------------------------------------------------------
+
+db_lease::db_lease(std::unique_ptr<pooled_connection> connection, pooled_connection **current)
+	: m_owned(std::move(connection))
+	, m_connection(m_owned.get())
+	, m_current(current)
+{
+	if (m_current != nullptr)
+		*m_current = m_connection;
+}
+
+db_lease::db_lease(pooled_connection *shared)
+	: m_connection(shared)
+{
+}
+
+db_lease::~db_lease()
+{
+	if (not m_owned)
+		return;
+
+	if (m_current != nullptr and *m_current == m_owned.get())
+		*m_current = nullptr;
+
+	auto pool = m_owned->pool;
+	pool->release(std::move(m_owned));
+}
+
+std::string db_lease::prepared(const std::string &sql)
+{
+	auto &prepared = m_connection->prepared;
+
+	auto i = prepared.find(sql);
+	if (i != prepared.end())
+		return i->second;
+
+	auto &connection = get();
+
+	if (prepared.size() >= kMaxPrepared)
+	{
+		for (auto &[text, name] : prepared)
+			connection.unprepare(name);
+		prepared.clear();
+	}
+
+	std::string name = db_connection::instance().statement_name(sql);
+
+	connection.prepare(name, sql);
+	prepared.emplace(sql, name);
+
+	return name;
+}
+
+// --------------------------------------------------------------------
+
 std::unique_ptr<db_connection> db_connection::s_instance;
-thread_local std::unique_ptr<pqxx::connection> db_connection::s_connection;
+thread_local pooled_connection *db_connection::s_current;
+thread_local pooled_connection *db_connection::s_current_read;
 
 void db_connection::init()
 {
 	auto &config = mcfp::config::instance();
 
 	std::ostringstream connectionString;
-	for (auto opt: { "db-host", "db-port", "db-dbname", "db-user", "db-password" })
+	for (auto opt: { "db-port", "db-dbname", "db-user", "db-password" })
 	{
 		if (not config.has(opt))
 			continue;
@@ -49,7 +469,41 @@ void db_connection::init()
 		connectionString << (opt + 3) << '=' << config.get(opt) << ' ';
 	}
 
-	s_instance.reset(new db_connection(connectionString.str()));
+	std::string primary = connectionString.str();
+	if (config.has("db-host"))
+		primary += "host=" + config.get("db-host");
+
+	// A comma separated list of host or host:port, the other settings are the same as for the primary
+	std::vector<std::string> replicas;
+	if (config.has("db-replica-host"))
+	{
+		std::istringstream hosts(config.get("db-replica-host"));
+		std::string host;
+		while (std::getline(hosts, host, ','))
+		{
+			if (host.empty())
+				continue;
+
+			std::string replica = connectionString.str();
+
+			auto colon = host.find(':');
+			if (colon != std::string::npos)
+			{
+				replica += " port=" + host.substr(colon + 1);
+				host.erase(colon);
+			}
+
+			replicas.emplace_back(replica + " host=" + host);
+		}
+	}
+
+	PoolOptions options;
+	options.max_size = std::max<size_t>(config.get<size_t>("db-pool-max"), 1);
+	options.min_size = std::min(config.get<size_t>("db-pool-min"), options.max_size);
+	options.timeout = std::chrono::seconds(config.get<unsigned>("db-pool-timeout"));
+	options.max_lag = std::chrono::seconds(config.get<unsigned>("db-replica-max-lag"));
+
+	s_instance.reset(new db_connection(primary, replicas, options));
 }
 
 db_connection& db_connection::instance()
@@ -59,21 +513,95 @@ db_connection& db_connection::instance()
 
 // --------------------------------------------------------------------
 
-db_connection::db_connection(const std::string& connectionString)
-	: m_connection_string(connectionString)
+db_connection::db_connection(const std::string &primary, const std::vector<std::string> &replicas, const PoolOptions &options)
+	: m_primary(new connection_pool(*this, primary, options, false))
+{
+	for (auto &replica : replicas)
+		m_replicas.emplace_back(new connection_pool(*this, replica, options, true));
+}
+
+db_connection::~db_connection()
+{
+}
+
+db_lease db_connection::acquire()
 {
+	if (s_current != nullptr)
+		return db_lease(s_current);
+
+	return db_lease(m_primary->checkout(), &s_current);
 }
 
-pqxx::connection& db_connection::get_connection()
+db_lease db_connection::acquire_read(bool exclusive)
 {
-	if (not s_connection)
-		s_connection.reset(new pqxx::connection(m_connection_string));
-	return *s_connection;
+	if (not exclusive)
+	{
+		if (s_current != nullptr)
+			return db_lease(s_current);
+
+		if (s_current_read != nullptr)
+			return db_lease(s_current_read);
+	}
+
+	auto current = exclusive ? nullptr : &s_current_read;
+
+	// Take turns, skipping the replicas that cannot be used right now
+	for (size_t i = 0; i < m_replicas.size(); ++i)
+	{
+		auto &replica = m_replicas[m_next_replica++ % m_replicas.size()];
+		if (not replica->usable())
+		{
+			// The first lag check makes it usable
+			replica->start();
+			continue;
+		}
+
+		try
+		{
+			return db_lease(replica->checkout(), current);
+		}
+		catch (const pqxx::broken_connection &ex)
+		{
+			replica->set_unusable(ex);
+		}
+		catch (const checkout_timeout &ex)
+		{
+			// Overloaded, leave it alone until the next lag check
+			replica->set_unusable(ex);
+		}
+	}
+
+	return db_lease(m_primary->checkout(), current);
 }
 
 void db_connection::reset()
 {
-	s_connection.reset();
+	m_primary->reset();
+	for (auto &replica : m_replicas)
+		replica->reset();
+}
+
+std::string db_connection::statement_name(const std::string &sql)
+{
+	std::unique_lock lock(m_mutex);
+
+	auto i = m_statements.find(sql);
+	if (i != m_statements.end())
+		return i->second;
+
+	std::string name = "pramd_" + std::to_string(++m_statement_count);
+
+	// Only the first statements are prepared on new connections
+	if (m_statements.size() < kMaxPrepared)
+		m_statements.emplace(sql, name);
+
+	return name;
+}
+
+std::unordered_map<std::string, std::string> db_connection::statements()
+{
+	std::unique_lock lock(m_mutex);
+	return m_statements;
 }
 
 // --------------------------------------------------------------------
@@ -26,42 +26,138 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include <pqxx/pqxx>
 
 #include <zeep/http/error-handler.hpp>
 
-class db_connection
+class connection_pool;
+
+/// \brief A connection in a pool with the statements prepared on it
+struct pooled_connection
+{
+	std::unique_ptr<pqxx::connection> connection;
+	connection_pool *pool;
+	std::unordered_map<std::string, std::string> prepared;	///< sql to statement name
+	std::chrono::steady_clock::time_point last_used;
+};
+
+// --------------------------------------------------------------------
+/// \brief A connection checked out from a pool, it is returned when the
+/// lease is destroyed. Leases acquired by a thread that already holds one
+/// share its connection, so nested calls do not use an extra connection.
+
+class db_lease
 {
   public:
-	static void init();
-	static db_connection& instance();
+	db_lease(db_lease &&rhs) = default;
+	db_lease &operator=(db_lease &&rhs) = delete;
+	~db_lease();
 
-	static pqxx::work start_transaction()
+	pqxx::connection &get() const
 	{
-		return pqxx::work(instance());
+		return *m_connection->connection;
 	}
 
-	pqxx::connection& get_connection();
-
-	operator pqxx::connection&()
+	operator pqxx::connection &() const
 	{
-		return get_connection();
+		return get();
 	}
 
+	/// \brief Return the name of a prepared statement for \a sql on this
+	/// connection, preparing it on first use
+	std::string prepared(const std::string &sql);
+
+  private:
+	friend class db_connection;
+
+	/// \brief Own \a connection, registering it in \a current unless that is null
+	db_lease(std::unique_ptr<pooled_connection> connection, pooled_connection **current);
+
+	/// \brief Share the connection owned by another lease of this thread
+	db_lease(pooled_connection *shared);
+
+	std::unique_ptr<pooled_connection> m_owned;
+	pooled_connection *m_connection;
+	pooled_connection **m_current = nullptr;
+};
+
+// --------------------------------------------------------------------
+
+struct PoolOptions
+{
+	size_t min_size = 2;						///< The number of connections kept open
+	size_t max_size = 16;						///< The maximum number of open connections
+	std::chrono::seconds timeout{ 30 };			///< Wait this long for a connection to become available
+	std::chrono::seconds max_lag{ 5 };			///< Replicas lagging further behind are not used
+};
+
+// --------------------------------------------------------------------
+/// \brief The connections to the database
+///
+/// Each server, the primary and the replicas in db-replica-host, has a pool
+/// of at most db-pool-max connections. A pool keeps at least db-pool-min of
+/// them open, reconnecting in a background thread and checking idle
+/// connections before they are handed out again. New connections prepare the
+/// statements used so far, so the first request using them does not pay for it.
+///
+/// Writes always go to the primary. Reads that can do with data a few seconds
+/// old use acquire_read, which takes turns between the replicas that are
+/// within db-replica-max-lag seconds of the primary.
+
+class db_connection
+{
+  public:
+	static void init();
+	static db_connection& instance();
+
+	~db_connection();
+
+	/// \brief Lease a connection to the primary for the current thread, waits at most
+	/// db-pool-timeout seconds for one to become available. Leases must be released
+	/// by the thread that acquired them.
+	db_lease acquire();
+
+	/// \brief Lease a connection for read only work, to a replica when one is available.
+	/// A thread holding a lease on the primary keeps using it, so it sees its own writes.
+	/// An \a exclusive lease is not shared with the current thread, use this for work
+	/// that outlives the request, like streaming a reply.
+	db_lease acquire_read(bool exclusive = false);
+
+	/// \brief Check the idle connections now, call this after a broken connection
 	void reset();
 
   private:
+	friend class connection_pool;
+	friend class db_lease;
+
 	db_connection(const db_connection&) = delete;
 	db_connection& operator=(const db_connection&) = delete;
 
-	db_connection(const std::string& connectionString);
+	db_connection(const std::string &primary, const std::vector<std::string> &replicas, const PoolOptions &options);
+
+	/// \brief Return the name for the statement \a sql, the same on all connections
+	std::string statement_name(const std::string &sql);
+
+	/// \brief The statements to prepare on a new connection
+	std::unordered_map<std::string, std::string> statements();
+
+	std::unique_ptr<connection_pool> m_primary;
+	std::vector<std::unique_ptr<connection_pool>> m_replicas;
+	std::atomic<size_t> m_next_replica = 0;
 
-	std::string m_connection_string;
+	std::mutex m_mutex;
+	std::unordered_map<std::string, std::string> m_statements;
+	size_t m_statement_count = 0;
 
 	static std::unique_ptr<db_connection> s_instance;
-	static thread_local std::unique_ptr<pqxx::connection> s_connection;
+	static thread_local pooled_connection *s_current, *s_current_read;
 };
 
 // --------------------------------------------------------------------
@@ -0,0 +1,429 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include "entry-reader.hpp"
+
+namespace
+{
+
+// --------------------------------------------------------------------
+// A minimal pull parser for JSON text
+
+class json_scanner
+{
+  public:
+	json_scanner(std::string_view text)
+		: m_text(text)
+	{
+	}
+
+	char peek()
+	{
+		skip_ws();
+		if (m_pos >= m_text.length())
+			error("unexpected end of text");
+		return m_text[m_pos];
+	}
+
+	void expect(char ch)
+	{
+		if (peek() != ch)
+			error(std::string("expected '") + ch + '\'');
+		++m_pos;
+	}
+
+	/// \brief Consume \a ch if it is the next character
+	bool accept(char ch)
+	{
+		if (peek() != ch)
+			return false;
+		++m_pos;
+		return true;
+	}
+
+	/// \brief Iterate over the members of an object, calls \a f with the key for each member
+	///
+	/// \a f should consume the value.
+	template <typename F>
+	void object(F &&f)
+	{
+		expect('{');
+		if (accept('}'))
+			return;
+
+		do
+		{
+			auto key = string();
+			expect(':');
+			f(key);
+		} while (accept(','));
+
+		expect('}');
+	}
+
+	std::string string()
+	{
+		expect('"');
+
+		std::string result;
+
+		for (;;)
+		{
+			if (m_pos == m_text.length())
+				error("unterminated string");
+
+			char ch = m_text[m_pos++];
+
+			if (ch == '"')
+				break;
+
+			if (ch != '\\')
+			{
+				result += ch;
+				continue;
+			}
+
+			if (m_pos == m_text.length())
+				error("unterminated string");
+
+			switch (ch = m_text[m_pos++])
+			{
+				case 'b': result += '\b'; break;
+				case 'f': result += '\f'; break;
+				case 'n': result += '\n'; break;
+				case 'r': result += '\r'; break;
+				case 't': result += '\t'; break;
+				case 'u': append_utf8(result, unicode()); break;
+				default: result += ch; break;
+			}
+		}
+
+		return result;
+	}
+
+	/// \brief Return the text of a number, true, false or null token
+	std::string_view token()
+	{
+		skip_ws();
+
+		auto start = m_pos;
+		while (m_pos < m_text.length() and (std::isalnum(static_cast<unsigned char>(m_text[m_pos])) or
+			m_text[m_pos] == '-' or m_text[m_pos] == '+' or m_text[m_pos] == '.'))
+		{
+			++m_pos;
+		}
+
+		if (start == m_pos)
+			error("invalid value");
+
+		return m_text.substr(start, m_pos - start);
+	}
+
+	/// \brief Skip over the next value
+	void skip()
+	{
+		switch (peek())
+		{
+			case '{':
+				object([this](const std::string &) { skip(); });
+				break;
+
+			case '[':
+				++m_pos;
+				if (not accept(']'))
+				{
+					do
+						skip();
+					while (accept(','));
+					expect(']');
+				}
+				break;
+
+			case '"':
+				skip_string();
+				break;
+
+			default:
+				token();
+				break;
+		}
+	}
+
+	[[noreturn]] void error(const std::string &msg)
+	{
+		throw std::runtime_error("JSON parse error at offset " + std::to_string(m_pos) + ": " + msg);
+	}
+
+  private:
+	void skip_ws()
+	{
+		while (m_pos < m_text.length() and std::isspace(static_cast<unsigned char>(m_text[m_pos])))
+			++m_pos;
+	}
+
+	void skip_string()
+	{
+		expect('"');
+		for (;;)
+		{
+			if (m_pos >= m_text.length())
+				error("unterminated string");
+
+			char ch = m_text[m_pos++];
+
+			if (ch == '"')
+				break;
+
+			if (ch == '\\')
+			{
+				if (m_pos == m_text.length())
+					error("unterminated string");
+				++m_pos;
+			}
+		}
+	}
+
+	uint32_t hex4()
+	{
+		if (m_pos + 4 > m_text.length())
+			error("invalid unicode escape");
+
+		uint32_t result = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			char ch = m_text[m_pos++];
+			result <<= 4;
+			if (ch >= '0' and ch <= '9')
+				result |= ch - '0';
+			else if (ch >= 'a' and ch <= 'f')
+				result |= ch - 'a' + 10;
+			else if (ch >= 'A' and ch <= 'F')
+				result |= ch - 'A' + 10;
+			else
+				error("invalid unicode escape");
+		}
+
+		return result;
+	}
+
+	uint32_t unicode()
+	{
+		auto result = hex4();
+
+		// surrogate pair
+		if (result >= 0xD800 and result < 0xDC00 and m_text.substr(m_pos, 2) == "\\u")
+		{
+			m_pos += 2;
+			auto low = hex4();
+			result = 0x10000 + ((result - 0xD800) << 10) + (low - 0xDC00);
+		}
+
+		return result;
+	}
+
+	static void append_utf8(std::string &s, uint32_t uc)
+	{
+		if (uc < 0x080)
+			s += static_cast<char>(uc);
+		else if (uc < 0x0800)
+		{
+			s += static_cast<char>(0x0c0 | (uc >> 6));
+			s += static_cast<char>(0x080 | (uc & 0x3f));
+		}
+		else if (uc < 0x00010000)
+		{
+			s += static_cast<char>(0x0e0 | (uc >> 12));
+			s += static_cast<char>(0x080 | ((uc >> 6) & 0x3f));
+			s += static_cast<char>(0x080 | (uc & 0x3f));
+		}
+		else
+		{
+			s += static_cast<char>(0x0f0 | (uc >> 18));
+			s += static_cast<char>(0x080 | ((uc >> 12) & 0x3f));
+			s += static_cast<char>(0x080 | ((uc >> 6) & 0x3f));
+			s += static_cast<char>(0x080 | (uc & 0x3f));
+		}
+	}
+
+	std::string_view m_text;
+	std::string_view::size_type m_pos = 0;
+};
+
+// --------------------------------------------------------------------
+// Value conversions, following the rules of zeep::json::element::as<>
+
+std::optional<std::string> optional_string(json_scanner &s)
+{
+	if (s.peek() == '"')
+		return s.string();
+
+	s.skip();
+	return {};
+}
+
+std::string as_string(json_scanner &s)
+{
+	if (s.peek() == '"')
+		return s.string();
+
+	return std::string(s.token());
+}
+
+bool as_bool(json_scanner &s)
+{
+	if (s.peek() == '"')
+		return s.string() == "true";
+
+	auto t = s.token();
+	if (t == "true")
+		return true;
+	if (t == "false" or t == "null")
+		return false;
+	return std::strtod(std::string(t).c_str(), nullptr) != 0;
+}
+
+double as_number(json_scanner &s)
+{
+	std::string t = s.peek() == '"' ? s.string() : std::string(s.token());
+
+	char *end;
+	double result = std::strtod(t.c_str(), &end);
+	if (end == t.c_str() or *end != 0)
+		s.error("invalid number " + t);
+
+	return result;
+}
+
+} // namespace
+
+// --------------------------------------------------------------------
+
+void extract_versions(std::string_view text, EntryData &entry)
+{
+	json_scanner s(text);
+
+	s.object([&](const std::string &key)
+	{
+		if (key == "data")
+		{
+			s.object([&](const std::string &field)
+			{
+				if (field == "coordinates_revision_date_pdb")
+					entry.coordinates_revision_date_pdb = optional_string(s);
+				else if (field == "coordinates_revision_major_mmCIF")
+					entry.coordinates_revision_major_mmCIF = optional_string(s);
+				else if (field == "coordinates_revision_minor_mmCIF")
+					entry.coordinates_revision_minor_mmCIF = optional_string(s);
+				else if (field == "coordinates_edited")
+					entry.coordinates_edited = as_bool(s);
+				else if (field == "reflections_revision")
+					entry.reflections_revision = as_string(s);
+				else if (field == "reflections_edited")
+					entry.reflections_edited = as_bool(s);
+				else
+					s.skip();
+			});
+		}
+		else if (key == "software")
+		{
+			s.object([&](const std::string &program)
+			{
+				bool used = false;
+				std::optional<std::string> version;
+
+				s.object([&](const std::string &field)
+				{
+					if (field == "used")
+						used = as_bool(s);
+					else if (field == "version")
+						version = optional_string(s);
+					else
+						s.skip();
+				});
+
+				if (version == "null")
+					version.reset();
+
+				if (used)
+					entry.software.emplace_back(program, version);
+			});
+		}
+		else
+			s.skip();
+	});
+}
+
+void extract_data(std::string_view text, const data_service &ds, EntryData &entry)
+{
+	json_scanner s(text);
+
+	s.object([&](const std::string &key)
+	{
+		if (key != "properties")
+		{
+			s.skip();
+			return;
+		}
+
+		s.object([&](const std::string &name)
+		{
+			if (s.peek() == 'n')
+			{
+				s.skip();	// null
+				return;
+			}
+
+			switch (ds.get_property_type(name))
+			{
+				case PropertyType::String:
+				{
+					auto value = as_string(s);
+					if (name == "TIME")
+						entry.data_time = value;
+					entry.properties.emplace_back(name, std::move(value));
+					break;
+				}
+
+				case PropertyType::Number:
+					entry.properties.emplace_back(name, as_number(s));
+					break;
+
+				case PropertyType::Boolean:
+					entry.properties.emplace_back(name, as_bool(s));
+					break;
+			}
+		});
+	});
+
+	if (entry.data_time.empty())
+		throw std::runtime_error("Missing TIME property in data.json");
+}
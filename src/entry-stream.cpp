@@ -0,0 +1,123 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <sstream>
+
+#include "entry-stream.hpp"
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+// The number of rows fetched from the cursor at a time
+const size_t kFetchSize = 1000;
+
+const char kCursorName[] = "entry_stream";
+
+} // namespace
+
+entry_streambuf::entry_streambuf(db_lease connection, const std::string &sql, const pqxx::params &params,
+	row_writer &&writer, const std::string &prefix, const std::string &separator, const std::string &suffix)
+	: m_connection(std::move(connection))
+	, m_writer(std::move(writer))
+	, m_buffer(prefix)
+	, m_separator(separator)
+	, m_suffix(suffix)
+{
+	m_tx.reset(new pqxx::work(m_connection));
+	m_tx->exec_params(std::string("declare ") + kCursorName + " no scroll cursor for " + sql, params);
+
+	setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + m_buffer.length());
+}
+
+entry_streambuf::~entry_streambuf()
+{
+	// Abort the transaction when the stream was not read to the end, this closes the
+	// cursor. The lease is released after this.
+	m_tx.reset();
+}
+
+entry_streambuf::int_type entry_streambuf::underflow()
+{
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+
+	try
+	{
+		if (not fetch())
+			return traits_type::eof();
+	}
+	catch (const std::exception &ex)
+	{
+		// Headers are gone already, all that can be done is truncating the output
+		std::cerr << "Error streaming entries: " << ex.what() << std::endl;
+
+		m_tx.reset();
+		m_done = true;
+		return traits_type::eof();
+	}
+
+	setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + m_buffer.length());
+
+	return traits_type::to_int_type(*gptr());
+}
+
+bool entry_streambuf::fetch()
+{
+	m_buffer.clear();
+
+	while (m_buffer.empty() and not m_done)
+	{
+		auto r = m_tx->exec(std::string("fetch ") + std::to_string(kFetchSize) + " from " + kCursorName);
+
+		if (r.empty())
+		{
+			m_tx->exec(std::string("close ") + kCursorName);
+			m_tx->commit();
+			m_tx.reset();
+
+			m_buffer = m_suffix;
+			m_done = true;
+			break;
+		}
+
+		std::ostringstream os;
+		for (auto const &row : r)
+		{
+			if (not m_first)
+				os << m_separator;
+			m_first = false;
+
+			m_writer(os, row);
+		}
+
+		m_buffer = os.str();
+	}
+
+	return not m_buffer.empty();
+}
@@ -0,0 +1,92 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <functional>
+#include <istream>
+#include <memory>
+#include <streambuf>
+
+#include <pqxx/pqxx>
+
+#include "db-connection.hpp"
+
+// --------------------------------------------------------------------
+/// \brief A streambuf producing the rows of a query as text, reading them
+/// from a server side cursor while the stream is consumed
+///
+/// The cursor lives in a transaction on a connection leased by the streambuf,
+/// the connection of the current thread remains available for other work.
+/// Rows are fetched in chunks, so memory use does not depend on the size of
+/// the result.
+
+class entry_streambuf : public std::streambuf
+{
+  public:
+	using row_writer = std::function<void(std::ostream &, const pqxx::row &)>;
+
+	/// \brief Declare a cursor for \a sql with \a params on \a connection. The
+	/// stream contains \a prefix, the rows written by \a writer separated by
+	/// \a separator and finally \a suffix
+	entry_streambuf(db_lease connection, const std::string &sql, const pqxx::params &params,
+		row_writer &&writer, const std::string &prefix, const std::string &separator, const std::string &suffix);
+	~entry_streambuf();
+
+	entry_streambuf(const entry_streambuf &) = delete;
+	entry_streambuf &operator=(const entry_streambuf &) = delete;
+
+  protected:
+	int_type underflow() override;
+
+  private:
+	/// \brief Fill m_buffer with the next chunk, returns false at the end of the stream
+	bool fetch();
+
+	db_lease m_connection;
+	std::unique_ptr<pqxx::work> m_tx;
+	row_writer m_writer;
+	std::string m_buffer, m_separator, m_suffix;
+	bool m_first = true, m_done = false;
+};
+
+// --------------------------------------------------------------------
+/// \brief An istream owning its entry_streambuf
+
+class entry_stream : public std::istream
+{
+  public:
+	template <typename... Args>
+	entry_stream(Args &&...args)
+		: std::istream(nullptr)
+		, m_buffer(std::forward<Args>(args)...)
+	{
+		rdbuf(&m_buffer);
+	}
+
+  private:
+	entry_streambuf m_buffer;
+};
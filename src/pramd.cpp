@@ -25,8 +25,10 @@
  */
 
 #include <date/date.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 #include <zeep/config.hpp>
 
@@ -38,6 +40,7 @@
 
 #include <mcfp/mcfp.hpp>
 
+#include "archive-watcher.hpp"
 #include "data-service.hpp"
 #include "db-connection.hpp"
 
@@ -75,9 +78,9 @@ class software_expression_utility_object : public zh::expression_utility_object<
 
 				auto sw = parameters.front().as<std::string>();
 
-				for (size_t ix = 0; ix < software.size(); ++ix)
+				for (size_t ix = 0; ix < software->size(); ++ix)
 				{
-					if (software[ix].name != sw)
+					if ((*software)[ix].name != sw)
 						continue;
 					
 					result = ix;
@@ -123,11 +126,14 @@ class api_rest_controller : public zh::rest_controller
 		// Actual query support
 
 		// return all results
-		map_post_request("q/query", &api_rest_controller::query_all, "query");
+		map_post_request("q/query", &api_rest_controller::query_all, "query", "fields");
 
 		// return paged results
 		map_post_request("q/query/{page}", &api_rest_controller::query_page, "query", "page");
 
+		// return the page of results following the entry with cursor 'after'
+		map_post_request("q/query-after", &api_rest_controller::query_after, "query", "after");
+
 		// return the count(*) for query
 		map_post_request("q/count", &api_rest_controller::query_count, "query");
 	}
@@ -135,13 +141,14 @@ class api_rest_controller : public zh::rest_controller
 	std::vector<Software> get_all_software()
 	{
 		auto &ds = data_service::instance();
-		return ds.get_software();
+		return *ds.get_software();
 	}
 
 	Software get_software(const std::string &name)
 	{
 		auto &ds = data_service::instance();
-		for (auto &sw : ds.get_software())
+		auto software = ds.get_software();
+		for (auto &sw : *software)
 		{
 			if (sw.name == name)
 				return sw;
@@ -178,9 +185,35 @@ class api_rest_controller : public zh::rest_controller
 		return rep;
 	}
 
-	std::vector<DbEntry> query_all(Query q)
+	zh::reply query_all(Query q, const std::string &fields)
 	{
-		return {};
+		auto &ds = data_service::instance();
+
+		// fields is a comma separated list of property names
+		std::vector<std::string> names;
+		for (std::string::size_type b = 0; b < fields.length();)
+		{
+			auto e = fields.find(',', b);
+			if (e == std::string::npos)
+				e = fields.length();
+
+			if (e > b)
+				names.emplace_back(fields.substr(b, e - b));
+			b = e + 1;
+		}
+
+		auto &properties = ds.get_properties();
+		for (auto &name : names)
+		{
+			if (std::find_if(properties.begin(), properties.end(), [&name](const Property &p) { return p.name == name; }) == properties.end())
+				throw zh::bad_request;
+		}
+
+		// The result is sent while it is read from the database, one entry per line
+		zh::reply rep{zh::ok};
+		rep.set_content(ds.stream_ndjson(q, names).release(), "application/x-ndjson");
+
+		return rep;
 	}
 
 	std::vector<DbEntry> query_page(Query q, int page)
@@ -189,6 +222,12 @@ class api_rest_controller : public zh::rest_controller
 		return ds.query(q, page, kPageSize);
 	}
 
+	std::vector<DbEntry> query_after(Query q, const std::string &after)
+	{
+		auto &ds = data_service::instance();
+		return ds.query_after(q, after, kPageSize);
+	}
+
 	size_t query_count(Query q)
 	{
 		auto &ds = data_service::instance();
@@ -238,10 +277,10 @@ void pram_html_controller::welcome(const zh::request &request, const zh::scope &
 
 	auto software = ds.get_software();
 	json se;
-	to_element(se, software);
+	to_element(se, *software);
 	sub.put("software", se);
 
-	auto properties = ds.get_properties();
+	auto &properties = ds.get_properties();
 	json pe;
 	to_element(pe, properties);
 	sub.put("properties", pe);
@@ -268,26 +307,34 @@ void pram_html_controller::export_results(const zh::request &request, const zh::
 	std::ostringstream ss;
 	ss << ymd << ' ' << time << " UTC";
 
-	json content{
-		{ "date", ss.str() },
-		{ "query", jq },
-		{ "entries", {} }
-	};
-
 	if (not jq.empty())
 	{
 		Query q;
 		from_element(jq, q);
 
-		auto dbentries = ds.query(q, 0, std::numeric_limits<uint32_t>::max());
-		to_element(content["entries"], dbentries);
+		// Write the document around the entries, these are streamed from the database
+		// as the reply is sent, using chunked transfer encoding
+		json date = ss.str();
+
+		std::ostringstream prefix;
+		prefix << R"({"date":)" << date << R"(,"query":)" << jq << R"(,"entries":[)";
+
+		reply.set_content(ds.stream_query(q, prefix.str(), "]}").release(), "application/json");
 	}
+	else
+	{
+		json content{
+			{ "date", ss.str() },
+			{ "query", jq },
+			{ "entries", {} }
+		};
 
-	std::unique_ptr<std::iostream> os(new std::stringstream);
+		std::unique_ptr<std::iostream> os(new std::stringstream);
 
-	*os << content;
+		*os << content;
 
-	reply.set_content(os.release(), "application/json");
+		reply.set_content(os.release(), "application/json");
+	}
 
 	std::string filename = "pdb-archive-query-result-(" + ss.str() + ").json";
 	std::string::size_type i = 0;
@@ -312,7 +359,10 @@ void pram_html_controller::entries_table(const zh::request &request, const zh::s
 	Query q;
 	from_element(jq, q);
 
-	auto dbentries = ds.query(q, page, kPageSize);
+	// Use the cursor of the last entry of the previous page when the client has it
+	auto dbentries = request.has_parameter("after")
+		? ds.query_after(q, request.get_parameter("after"), kPageSize)
+		: ds.query(q, page, kPageSize);
 
 	json entries;
 	to_element(entries, dbentries);
@@ -331,7 +381,7 @@ void pram_html_controller::program_filter(const zh::request &request, const zh::
 
 	auto software = ds.get_software();
 	json se;
-	to_element(se, software);
+	to_element(se, *software);
 	sub.put("software", se);
 
 	auto program = request.get_parameter("program");
@@ -349,7 +399,7 @@ void pram_html_controller::property_filter(const zh::request &request, const zh:
 	zh::scope sub(scope);
 	auto &ds = data_service::instance();
 
-	auto properties = ds.get_properties();
+	auto &properties = ds.get_properties();
 	json se;
 	to_element(se, properties);
 	sub.put("properties", se);
@@ -390,7 +440,25 @@ int a_main(int argc, char *const argv[])
 		mcfp::make_option<std::string>("db-port", "Database port"),
 		mcfp::make_option<std::string>("db-dbname", "Database name"),
 		mcfp::make_option<std::string>("db-user", "Database user name"),
-		mcfp::make_option<std::string>("db-password", "Database password"));
+		mcfp::make_option<std::string>("db-password", "Database password"),
+		mcfp::make_option<size_t>("db-pool-min", 2, "Number of database connections kept open"),
+		mcfp::make_option<size_t>("db-pool-max", 16, "Maximum number of open database connections"),
+		mcfp::make_option<unsigned>("db-pool-timeout", 30, "Number of seconds to wait for a free database connection"),
+		mcfp::make_option<std::string>("db-replica-host", "Comma separated list of read only replicas, as host or host:port"),
+		mcfp::make_option<unsigned>("db-replica-max-lag", 5, "Do not use a replica lagging more than this number of seconds behind"),
+		mcfp::make_option<size_t>("threads,t", std::thread::hardware_concurrency(), "Number of threads reading new entries during rescan"),
+		mcfp::make_option<size_t>("writer-threads", 2, "Number of threads writing new entries to the database during rescan"),
+		mcfp::make_option<size_t>("queue-size", 1000, "Maximum number of entries waiting between two rescan stages"),
+		mcfp::make_option<size_t>("batch-size", 250, "Number of new entries to write per transaction during rescan"),
+		mcfp::make_option("full", "Rescan all directories, ignoring the manifest of the previous rescan"),
+		mcfp::make_option("resume", "Continue an interrupted rescan, skipping the shards it completed"),
+		mcfp::make_option("reconcile", "Remove entries that no longer exist in pdb-redo-dir during rescan"),
+		mcfp::make_option<std::string>("stats-json", "Write the rescan statistics as JSON to this file"),
+		mcfp::make_option("watch", "Watch pdb-redo-dir for new entries while the server is running"),
+		mcfp::make_option<unsigned>("watch-delay", 5, "Number of seconds to wait after the last change to a new entry before importing it"),
+		mcfp::make_option<size_t>("watch-queue-size", 1000, "Maximum number of new entries waiting to be imported"),
+		mcfp::make_option<size_t>("query-cache-size", 256, "Memory for cached query results in megabytes, 0 disables the cache"),
+		mcfp::make_option("column-store", "Keep all properties in memory and evaluate queries without the database"));
 
 	std::error_code ec;
 	config.parse(argc, argv, ec);
@@ -426,7 +494,9 @@ Command should be either:
   status    get the status of a running server
   reload    restart a running server with new options
   reinit    re-initialise the database
+  upgrade   update the database schema, keeping the entries
   rescan    update the database with new entries
+  watch     watch for new entries and import them as they appear
 			 )" << std::endl;
 		exit(config.has("help") ? 0 : 1);
 	}
@@ -443,20 +513,69 @@ Command should be either:
 		return 0;
 	}
 
+	if (command == "upgrade")
+	{
+		data_service::upgrade();
+		return 0;
+	}
+
 	if (not config.has("pdb-redo-dir"))
 	{
 		std::cerr << "Missing pdb-redo-dir option" << std::endl;
 		exit(1);
 	}
 
+	// A batch or queue of zero entries would never make progress
+	for (auto option : { "batch-size", "queue-size", "watch-queue-size" })
+	{
+		if (config.get<size_t>(option) == 0)
+		{
+			std::cerr << "The " << option << " option must be at least 1" << std::endl;
+			exit(1);
+		}
+	}
+
 	if (command == "rescan")
 	{
-		data_service::instance().rescan();
+		RescanOptions options;
+		options.threads = config.get<size_t>("threads");
+		options.writer_threads = config.get<size_t>("writer-threads");
+		options.queue_size = config.get<size_t>("queue-size");
+		options.batch_size = config.get<size_t>("batch-size");
+		options.full = config.has("full");
+		options.resume = config.has("resume");
+		options.reconcile = config.has("reconcile");
+		if (config.has("stats-json"))
+			options.stats_json = config.get("stats-json");
+
+		data_service::instance().rescan(options);
 		return 0;
 	}
 
-	zh::daemon server([&config]()
+	WatchOptions watch_options;
+	watch_options.delay = std::chrono::seconds(config.get<unsigned>("watch-delay"));
+	watch_options.batch_size = config.get<size_t>("batch-size");
+	watch_options.queue_size = config.get<size_t>("watch-queue-size");
+
+	if (command == "watch")
+	{
+		archive_watcher watcher(config.get("pdb-redo-dir"), watch_options);
+		watcher.run();
+		return 0;
+	}
+
+	zh::daemon server([&config, watch_options]()
 		{
+		if (config.has("watch"))
+		{
+			static std::unique_ptr<archive_watcher> s_watcher;
+			if (not s_watcher)
+			{
+				s_watcher.reset(new archive_watcher(config.get("pdb-redo-dir"), watch_options));
+				s_watcher->start();
+			}
+		}
+
 		auto s = new zeep::http::server{};
 
 		if (config.has("context"))
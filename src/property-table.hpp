@@ -0,0 +1,124 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2023 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/// \file
+/// The properties defined in data.json.schema, compiled into a table at build
+/// time along with a hash index for looking them up by name.
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+
+#include "data-service.hpp"
+
+// --------------------------------------------------------------------
+
+struct PropertyTableEntry
+{
+	std::string_view name;
+	PropertyType type;
+};
+
+/// The properties ordered by name, the index in this table is the ordinal of a property
+inline constexpr PropertyTableEntry kPropertyTable[] = {
+#include "property-table.inc"
+};
+
+inline constexpr size_t kPropertyCount = std::size(kPropertyTable);
+
+// --------------------------------------------------------------------
+// The index is an open addressing hash table holding ordinals, it is at
+// most half full so the probe sequences stay short.
+
+constexpr uint32_t property_hash(std::string_view name)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (char c : name)
+	{
+		h ^= static_cast<uint8_t>(c);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+constexpr size_t property_index_size(size_t count)
+{
+	size_t result = 1;
+	while (result < 2 * count)
+		result <<= 1;
+	return result;
+}
+
+inline constexpr size_t kPropertyIndexSize = property_index_size(kPropertyCount);
+
+constexpr std::array<int16_t, kPropertyIndexSize> make_property_index()
+{
+	std::array<int16_t, kPropertyIndexSize> index{};
+	for (size_t slot = 0; slot < kPropertyIndexSize; ++slot)
+		index[slot] = -1;
+
+	for (size_t i = 0; i < kPropertyCount; ++i)
+	{
+		auto slot = property_hash(kPropertyTable[i].name) & (kPropertyIndexSize - 1);
+		while (index[slot] >= 0)
+			slot = (slot + 1) & (kPropertyIndexSize - 1);
+		index[slot] = static_cast<int16_t>(i);
+	}
+
+	return index;
+}
+
+inline constexpr auto kPropertyIndex = make_property_index();
+
+/// \brief Return the ordinal of the property called \a name, or -1 if there is no such property
+constexpr int find_property(std::string_view name)
+{
+	for (auto slot = property_hash(name) & (kPropertyIndexSize - 1); kPropertyIndex[slot] >= 0;
+		 slot = (slot + 1) & (kPropertyIndexSize - 1))
+	{
+		if (kPropertyTable[kPropertyIndex[slot]].name == name)
+			return kPropertyIndex[slot];
+	}
+
+	return -1;
+}
+
+constexpr bool property_table_is_valid()
+{
+	// Each name must find its own entry, which fails for duplicates
+	for (size_t i = 0; i < kPropertyCount; ++i)
+	{
+		if (find_property(kPropertyTable[i].name) != static_cast<int>(i))
+			return false;
+	}
+	return true;
+}
+
+static_assert(property_table_is_valid(), "data.json.schema contains duplicate property names");
@@ -0,0 +1,133 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "query-cache.hpp"
+#include "data-service.hpp"
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+// A single result may use at most this part of the cache
+const size_t kMaxResultFraction = 4;
+
+// A rough estimate of the memory used by a typical entry, the version hash
+// and the cursor do not fit the small string buffer.
+const size_t kEntrySize = sizeof(DbEntry) + 128;
+
+// The memory allocated by \a s, if any
+size_t allocated_size(const std::string &s)
+{
+	auto data = s.data();
+	auto self = reinterpret_cast<const char *>(&s);
+
+	if (data >= self and data < self + sizeof(s))
+		return 0;
+
+	return s.capacity() + 1;
+}
+
+size_t estimated_size(const query_cache::entry_list &entries)
+{
+	size_t result = sizeof(std::vector<DbEntry>);
+	if (entries)
+	{
+		result += entries->capacity() * sizeof(DbEntry);
+		for (auto &e : *entries)
+			result += allocated_size(e.pdb_id) + allocated_size(e.version_hash) + allocated_size(e.date) + allocated_size(e.cursor);
+	}
+	return result;
+}
+
+} // namespace
+
+query_cache::query_cache(size_t max_bytes)
+	: m_max_bytes(max_bytes)
+{
+}
+
+size_t query_cache::max_result_size() const
+{
+	return m_max_bytes / kMaxResultFraction / kEntrySize;
+}
+
+void query_cache::set_generation(uint64_t generation)
+{
+	if (generation > m_generation)
+	{
+		m_lru.clear();
+		m_index.clear();
+		m_bytes = 0;
+		m_generation = generation;
+	}
+}
+
+std::optional<query_cache::entry_list> query_cache::get(const std::string &key, uint64_t generation)
+{
+	std::unique_lock lock(m_mutex);
+
+	set_generation(generation);
+
+	auto i = m_index.find(key);
+	if (i == m_index.end())
+		return {};
+
+	// move to the front, marking it as most recently used
+	m_lru.splice(m_lru.begin(), m_lru, i->second);
+
+	return i->second->entries;
+}
+
+void query_cache::put(const std::string &key, uint64_t generation, entry_list entries)
+{
+	std::unique_lock lock(m_mutex);
+
+	set_generation(generation);
+
+	// a result computed before the last ingest
+	if (generation < m_generation or m_index.count(key))
+		return;
+
+	auto size = estimated_size(entries) + key.length();
+
+	m_lru.push_front(Item{ key, std::move(entries), size });
+	m_index.emplace(key, m_lru.begin());
+	m_bytes += size;
+
+	evict();
+}
+
+void query_cache::evict()
+{
+	while (m_bytes > m_max_bytes and not m_lru.empty())
+	{
+		auto &item = m_lru.back();
+		m_bytes -= item.size;
+		m_index.erase(item.key);
+		m_lru.pop_back();
+	}
+}
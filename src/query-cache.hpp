@@ -0,0 +1,89 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DbEntry;
+
+// --------------------------------------------------------------------
+/// \brief An LRU cache of complete query results, keyed on a canonical
+/// form of the query.
+///
+/// All cached results belong to one ingest generation, looking up or
+/// storing a result for a newer generation empties the cache. A result
+/// that is too large to cache is remembered as such, so that callers
+/// do not keep trying.
+
+class query_cache
+{
+  public:
+	using entry_list = std::shared_ptr<const std::vector<DbEntry>>;
+
+	/// \brief Create a cache holding at most \a max_bytes of results
+	query_cache(size_t max_bytes);
+
+	query_cache(const query_cache &) = delete;
+	query_cache &operator=(const query_cache &) = delete;
+
+	/// \brief Look up the result for \a key
+	///
+	/// \returns An empty optional when the result is not cached, a null
+	/// entry_list when the result is known to be too large.
+	std::optional<entry_list> get(const std::string &key, uint64_t generation);
+
+	/// \brief Store \a entries as the result for \a key, a null \a entries
+	/// marks the result as too large
+	void put(const std::string &key, uint64_t generation, entry_list entries);
+
+	/// \brief The maximum number of entries in a result that will be cached
+	size_t max_result_size() const;
+
+  private:
+	struct Item
+	{
+		std::string key;
+		entry_list entries;
+		size_t size;
+	};
+
+	void set_generation(uint64_t generation);
+	void evict();
+
+	std::mutex m_mutex;
+	std::list<Item> m_lru;
+	std::unordered_map<std::string, std::list<Item>::iterator> m_index;
+	size_t m_bytes = 0, m_max_bytes;
+	uint64_t m_generation = 0;
+};
@@ -0,0 +1,204 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <pqxx/pqxx>
+
+#include "db-connection.hpp"
+#include "query-stats.hpp"
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+// Statistics for older generations are used for at least this long
+const auto kMinAge = std::chrono::minutes(5);
+
+/// Parse a one dimensional array of numbers as returned by Postgres
+std::vector<double> parse_array(const std::string &s)
+{
+	std::vector<double> result;
+
+	std::istringstream is(s.substr(1, s.length() - 2));
+	for (std::string v; std::getline(is, v, ',');)
+		result.push_back(std::stod(v));
+
+	return result;
+}
+
+} // namespace
+
+// --------------------------------------------------------------------
+
+double query_stats::NumberStats::fraction_below(double x) const
+{
+	if (x <= bounds.front())
+		return 0;
+	if (x > bounds.back())
+		return 1;
+
+	// Each bucket holds the same number of values, interpolate within the bucket
+	auto i = std::lower_bound(bounds.begin(), bounds.end(), x) - bounds.begin();
+	auto lo = bounds[i - 1], hi = bounds[i];
+	auto within = hi > lo ? (x - lo) / (hi - lo) : 1;
+
+	return (i - 1 + within) / (bounds.size() - 1);
+}
+
+// --------------------------------------------------------------------
+
+query_stats::query_stats(const data_service &ds)
+	: m_ds(ds)
+{
+}
+
+void query_stats::refresh(uint64_t generation)
+{
+	{
+		std::unique_lock lock(m_mutex);
+		if (m_data and (m_data->generation >= generation or std::chrono::steady_clock::now() - m_data->loaded < kMinAge))
+			return;
+	}
+
+	m_loader.load("the query statistics", m_mutex, m_data, [this, generation]() { return load(generation); });
+}
+
+std::shared_ptr<const query_stats::Data> query_stats::load(uint64_t generation)
+{
+	auto data = std::make_shared<Data>();
+	data->generation = generation;
+	data->loaded = std::chrono::steady_clock::now();
+
+	std::ostringstream fractions;
+	for (size_t i = 0; i <= kBuckets; ++i)
+		fractions << (i ? ", " : "") << double(i) / kBuckets;
+
+	auto connection = db_connection::instance().acquire();
+	pqxx::work tx(connection);
+
+	data->entries = tx.query_value<size_t>("SELECT count(*) FROM dbentry");
+
+	for (const auto &[name, version, count] : tx.stream<std::string, std::optional<std::string>, size_t>(
+			 "SELECT s.name, s.version, count(*) FROM dbentry_software es JOIN software s ON s.id = es.software_id GROUP BY s.name, s.version"))
+		data->software[{ name, version }] = count;
+
+	for (const auto &[name, value, count] : tx.stream<std::string, bool, size_t>(
+			 "SELECT p.name, pb.value, count(*) FROM dbentry_property_boolean pb JOIN property p ON p.id = pb.property_id GROUP BY p.name, pb.value"))
+		data->booleans[{ name, value }] = count;
+
+	for (const auto &[name, count, distinct] : tx.stream<std::string, size_t, size_t>(
+			 "SELECT p.name, count(*), count(DISTINCT ps.value) FROM dbentry_property_string ps JOIN property p ON p.id = ps.property_id GROUP BY p.name"))
+		data->strings[name] = StringStats{ count, distinct };
+
+	for (const auto &[name, count, bounds] : tx.stream<std::string, size_t, std::string>(
+			 "SELECT p.name, count(*), percentile_disc(ARRAY[" + fractions.str() + "]::double precision[]) WITHIN GROUP (ORDER BY pn.value)"
+			 "  FROM dbentry_property_number pn JOIN property p ON p.id = pn.property_id GROUP BY p.name"))
+		data->numbers[name] = NumberStats{ count, parse_array(bounds) };
+
+	tx.commit();
+
+	return data;
+}
+
+// --------------------------------------------------------------------
+
+double query_stats::selectivity(const Filter &filter) const
+{
+	std::shared_ptr<const Data> data;
+	{
+		std::unique_lock lock(m_mutex);
+		data = m_data;
+	}
+
+	if (not data or data->entries == 0)
+		return 1;
+
+	double n = data->entries;
+
+	if (filter.type == FilterType::Software)
+	{
+		std::optional<std::string> version;
+		if (filter.value != "undefined")
+			version = filter.value;
+
+		auto i = data->software.find({ filter.subject, version });
+		return i == data->software.end() ? 0 : i->second / n;
+	}
+
+	switch (m_ds.get_property_type(filter.subject))
+	{
+		case PropertyType::Boolean:
+		{
+			auto i = data->booleans.find({ filter.subject, filter.value == "true" });
+			return i == data->booleans.end() ? 0 : i->second / n;
+		}
+
+		case PropertyType::String:
+		{
+			auto i = data->strings.find(filter.subject);
+			if (i == data->strings.end())
+				return 0;
+
+			// Assume the values are evenly distributed
+			auto &s = i->second;
+			double eq = s.distinct ? 1.0 / s.distinct : 1;
+			return (filter.op == OperatorType::EQ ? eq : 1 - eq) * s.count / n;
+		}
+
+		case PropertyType::Number:
+		{
+			auto i = data->numbers.find(filter.subject);
+			if (i == data->numbers.end())
+				return 0;
+
+			auto &s = i->second;
+			if (s.bounds.size() < 2)
+				return s.count / n;
+
+			double x = std::stod(filter.value);
+			double below = s.fraction_below(x);
+			double f;
+
+			switch (filter.op)
+			{
+				case OperatorType::LT:
+				case OperatorType::LE: f = below; break;
+				case OperatorType::GT:
+				case OperatorType::GE: f = 1 - below; break;
+				case OperatorType::EQ: f = x < s.bounds.front() or x > s.bounds.back() ? 0 : 1.0 / kBuckets; break;
+				default: f = 1; break;
+			}
+
+			return f * s.count / n;
+		}
+	}
+
+	return 1;
+}
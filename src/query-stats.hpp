@@ -0,0 +1,104 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2022 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "data-service.hpp"
+
+// --------------------------------------------------------------------
+/// \brief Statistics on the software and property tables, used to
+/// estimate how selective a filter is.
+///
+/// Kept are the number of entries per software version and per boolean
+/// value, the number of values and distinct values per string property
+/// and the number of values, minimum, maximum and an equi-depth histogram
+/// per numeric property. The statistics are refreshed in the background
+/// after ingest, at most once every few minutes.
+
+class query_stats
+{
+  public:
+	query_stats(const data_service &ds);
+
+	query_stats(const query_stats &) = delete;
+	query_stats &operator=(const query_stats &) = delete;
+
+	/// \brief Start a refresh when there are no statistics yet, or when they
+	/// are older than \a generation and have not been refreshed recently
+	void refresh(uint64_t generation);
+
+	/// \brief The estimated fraction of entries matching \a filter, one when unknown
+	double selectivity(const Filter &filter) const;
+
+  private:
+	static const size_t kBuckets = 32;
+
+	struct NumberStats
+	{
+		size_t count;
+		std::vector<double> bounds;	///< kBuckets + 1 values, the first is the minimum, the last the maximum
+
+		/// \brief The estimated fraction of the values less than \a x
+		double fraction_below(double x) const;
+	};
+
+	struct StringStats
+	{
+		size_t count;
+		size_t distinct;
+	};
+
+	struct Data
+	{
+		uint64_t generation;
+		std::chrono::steady_clock::time_point loaded;
+
+		size_t entries = 0;
+		std::map<std::tuple<std::string, std::optional<std::string>>, size_t> software;
+		std::map<std::tuple<std::string, bool>, size_t> booleans;
+		std::unordered_map<std::string, StringStats> strings;
+		std::unordered_map<std::string, NumberStats> numbers;
+	};
+
+	std::shared_ptr<const Data> load(uint64_t generation);
+
+	const data_service &m_ds;
+
+	mutable std::mutex m_mutex;
+	std::shared_ptr<const Data> m_data;
+
+	background_job m_loader;
+};
@@ -32,14 +32,17 @@
 #include <iomanip>
 
 #include <cmath>
+#include <ctime>
 #include <list>
 #include <iostream>
 #include <regex>
 #include <atomic>
 #include <mutex>
 
+#include <pqxx/pqxx>
 #include <zeep/streambuf.hpp>
 
+#include "db-connection.hpp"
 #include "utilities.hpp"
 
 const auto kProcessorCount = std::thread::hardware_concurrency();
@@ -90,6 +93,42 @@ void parallel_for(size_t N, std::function<void(size_t)>&& f)
 // #endif
 }
 
+// --------------------------------------------------------------------
+
+background_job::~background_job()
+{
+	std::unique_lock lock(m_mutex);
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void background_job::start(std::function<void()> &&job)
+{
+	std::unique_lock lock(m_mutex);
+
+	if (m_running)
+		return;
+
+	if (m_thread.joinable())
+		m_thread.join();
+
+	m_running = true;
+
+	m_thread = std::thread([this, job = std::move(job)]()
+		{
+		job();
+		m_running = false; });
+}
+
+void background_job::report_failure(const std::string &what, const std::exception &ex)
+{
+	// The pools may hold more connections to a server that went away
+	if (dynamic_cast<const pqxx::broken_connection *>(&ex) != nullptr)
+		db_connection::instance().reset();
+
+	std::cerr << "Loading " << what << " failed: " << ex.what() << std::endl;
+}
+
 // -----------------------------------------------------------------------
 
 int get_terminal_width()
@@ -140,6 +179,7 @@ struct progress_impl
 	std::mutex mMutex;
 	std::thread mThread;
 	std::chrono::time_point<std::chrono::system_clock> mStart = std::chrono::system_clock::now();
+	std::clock_t mStartCPU = std::clock();
 };
 
 void progress_impl::Run()
@@ -252,7 +292,7 @@ std::ostream& operator<<(std::ostream& os, const std::chrono::duration<double>&
 		s %= 60;
 	}
 	
-	double ss = s + 1e-6 * (t.count() - s);
+	double ss = s + (t.count() - std::trunc(t.count()));
 	
 	os << std::fixed << std::setprecision(1) << ss << 's';
 
@@ -266,9 +306,10 @@ void progress_impl::PrintDone()
 	std::string::size_type width = 80;
 
 	std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - mStart;
+	std::chrono::duration<double> cpu(static_cast<double>(std::clock() - mStartCPU) / CLOCKS_PER_SEC);
 
 	std::ostringstream msgstr;
-	msgstr << mAction << " done in " << elapsed << " cpu / %ws wall";
+	msgstr << mAction << " done in " << cpu << " cpu / " << elapsed << " wall";
 	auto msg = msgstr.str();
 
 	if (msg.length() < width)
@@ -26,7 +26,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 // --------------------------------------------------------------------
 
@@ -49,6 +59,157 @@ constexpr bool icompare(std::string_view a, std::string_view b)
 
 void parallel_for(size_t N, std::function<void(size_t)>&& f);
 
+// --------------------------------------------------------------------
+/// \brief A bounded queue connecting producer and consumer threads
+
+template <typename T>
+class blocking_queue
+{
+  public:
+	/// \brief A queue holding at most \a max_size values, at least one
+	blocking_queue(size_t max_size)
+		: m_max_size(std::max<size_t>(max_size, 1))
+	{
+	}
+
+	blocking_queue(const blocking_queue &) = delete;
+	blocking_queue &operator=(const blocking_queue &) = delete;
+
+	/// \brief Add \a value to the queue, blocks as long as the queue is full
+	void push(T &&value)
+	{
+		std::unique_lock lock(m_mutex);
+		m_not_full.wait(lock, [this]() { return m_closed or m_queue.size() < m_max_size; });
+
+		if (m_closed)
+			throw std::logic_error("push on a closed queue");
+
+		m_queue.emplace_back(std::move(value));
+		m_not_empty.notify_one();
+	}
+
+	/// \brief Return the next value, blocks as long as the queue is empty.
+	/// Returns nothing when the queue is empty and closed.
+	std::optional<T> pop()
+	{
+		std::unique_lock lock(m_mutex);
+		m_not_empty.wait(lock, [this]() { return m_closed or not m_queue.empty(); });
+
+		return take();
+	}
+
+	/// \brief Return the next value if one is available right away
+	std::optional<T> try_pop()
+	{
+		std::unique_lock lock(m_mutex);
+		return take();
+	}
+
+	/// \brief No more values will be pushed, wakes up all waiting consumers
+	void close()
+	{
+		std::unique_lock lock(m_mutex);
+		m_closed = true;
+		m_not_empty.notify_all();
+		m_not_full.notify_all();
+	}
+
+  private:
+	std::optional<T> take()
+	{
+		std::optional<T> result;
+
+		if (not m_queue.empty())
+		{
+			result.emplace(std::move(m_queue.front()));
+			m_queue.pop_front();
+			m_not_full.notify_one();
+		}
+
+		return result;
+	}
+
+	size_t m_max_size;
+	bool m_closed = false;
+	std::deque<T> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty, m_not_full;
+};
+
+// --------------------------------------------------------------------
+/// \brief Add the time spent in the current scope to \a counter, in nanoseconds.
+/// Does nothing if \a counter is null.
+
+class scoped_timer
+{
+  public:
+	scoped_timer(std::atomic<int64_t> *counter)
+		: m_counter(counter)
+		, m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	scoped_timer(const scoped_timer &) = delete;
+	scoped_timer &operator=(const scoped_timer &) = delete;
+
+	~scoped_timer()
+	{
+		if (m_counter != nullptr)
+			*m_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+	}
+
+  private:
+	std::atomic<int64_t> *m_counter;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// --------------------------------------------------------------------
+/// \brief Runs one job at a time in a background thread, the job should
+/// handle its own errors. The destructor waits for a running job, so declare
+/// it after the members the job uses.
+
+class background_job
+{
+  public:
+	background_job() = default;
+	~background_job();
+
+	background_job(const background_job &) = delete;
+	background_job &operator=(const background_job &) = delete;
+
+	/// \brief Run \a job in a background thread, unless the previous job is still running
+	void start(std::function<void()> &&job);
+
+	/// \brief Start a job replacing \a data, guarded by \a mutex, with the result of
+	/// \a loader unless \a data is of a newer generation by then. A failure is reported
+	/// as failing to load \a what.
+	template <typename Mutex, typename Ptr, typename Loader>
+	void load(const std::string &what, Mutex &mutex, Ptr &data, Loader &&loader)
+	{
+		start([what, &mutex, &data, loader = std::forward<Loader>(loader)]()
+			{
+			try
+			{
+				Ptr result = loader();
+
+				std::unique_lock lock(mutex);
+				if (not data or data->generation < result->generation)
+					data = std::move(result);
+			}
+			catch (const std::exception &ex)
+			{
+				report_failure(what, ex);
+			} });
+	}
+
+  private:
+	static void report_failure(const std::string &what, const std::exception &ex);
+
+	std::mutex m_mutex;
+	std::thread m_thread;
+	std::atomic<bool> m_running = false;
+};
+
 // --------------------------------------------------------------------
 
 int get_terminal_width();
@@ -42,6 +42,9 @@ class Pager {
 		this.lastPage = lastPage;
 		this.pageSize = PAGE_SIZE;
 
+		// the cursor of the last entry before each page, when known
+		this.cursors = { 1: '' };
+
 		this.updateButtons();
 		this.selectPage(1);
 	}
@@ -73,6 +76,11 @@ class Pager {
 		const fd = new FormData();
 		fd.append('query', this.q);
 
+		// seeking from a cursor is cheaper than skipping rows
+		const cursor = this.cursors[page];
+		if (cursor !== undefined)
+			fd.append('after', cursor);
+
 		fetch(`./entries-table?page=${page - 1}`, {
 			credentials: "include",
 			method: "post",
@@ -84,6 +92,11 @@ class Pager {
 		}).then(table => {
 			this.tbl.innerHTML = table;
 			this.page = page;
+
+			const rows = this.tbl.querySelectorAll('tr[data-cursor]');
+			if (rows.length > 0)
+				this.cursors[page + 1] = rows[rows.length - 1].getAttribute('data-cursor');
+
 			this.updateButtons();
 		}).catch(err => {
 			console.log(err);